@@ -0,0 +1,279 @@
+/* Benchmark of the png2gba conversion stages on a synthetic corpus of
+ * images, reporting the throughput of each stage and the peak memory
+ * use, run with make bench */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "png2gba_internal.h"
+
+/* how long to keep repeating each stage for, in seconds */
+#define BENCH_TIME 0.2
+
+/* a synthetic image, both decoded and encoded as a png */
+struct Sample {
+	int width, height, channels, colors;
+	png_bytep pixels;
+	png_bytep *rows;
+	unsigned char *png;
+	size_t png_size, png_capacity;
+};
+
+double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/* appends what libpng writes to the sample's png buffer */
+void write_memory(png_structp png, png_bytep data, png_size_t length) {
+	struct Sample *sample = png_get_io_ptr(png);
+	if (sample->png_size + length > sample->png_capacity) {
+		sample->png_capacity = (sample->png_size + length) * 2;
+		sample->png = realloc(sample->png, sample->png_capacity);
+	}
+	memcpy(sample->png + sample->png_size, data, length);
+	sample->png_size += length;
+}
+
+void flush_memory(png_structp png) {
+	(void)png;
+}
+
+/* fills a sample with blocks of colors from a random palette, with
+ * some noise so it neither compresses nor dedups too well */
+void make_sample(struct Sample *sample,
+				 int width,
+				 int height,
+				 int channels,
+				 int colors) {
+	sample->width = width;
+	sample->height = height;
+	sample->channels = channels;
+	sample->colors = colors;
+	sample->pixels = malloc((size_t)width * height * channels);
+	sample->rows = malloc(sizeof(png_bytep) * height);
+
+	unsigned int seed = width * 31 + colors;
+	png_byte (*palette)[3] = malloc(sizeof(*palette) * colors);
+	int i, x, y;
+	for (i = 0; i < colors; i++) {
+		/* spread the colors out so they stay distinct in 15 bits */
+		palette[i][0] = (i & 0x1F) << 3;
+		palette[i][1] = ((i >> 5) & 0x1F) << 3;
+		palette[i][2] = ((i >> 10) & 0x1F) << 3;
+	}
+
+	for (y = 0; y < height; y++) {
+		sample->rows[y] = sample->pixels + (size_t)y * width * channels;
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+			int color = ((x / 4) * 7 + (y / 4) * 13) % colors;
+			if ((seed >> 16) % 8 == 0) {
+				color = (seed >> 8) % colors;
+			}
+			png_bytep pixel = sample->rows[y] + x * channels;
+			memcpy(pixel, palette[color], 3);
+			if (channels == 4) {
+				pixel[3] = 0xFF;
+			}
+		}
+	}
+	free(palette);
+
+	/* and encode it */
+	png_structp png =
+		png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png_create_info_struct(png);
+	if (setjmp(png_jmpbuf(png))) {
+		fprintf(stderr, "Error: Could not write PNG file!\n");
+		exit(-1);
+	}
+	sample->png = NULL;
+	sample->png_size = 0;
+	sample->png_capacity = 0;
+	png_set_write_fn(png, sample, write_memory, flush_memory);
+	png_set_IHDR(png,
+				 info,
+				 width,
+				 height,
+				 8,
+				 channels == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+				 PNG_INTERLACE_NONE,
+				 PNG_COMPRESSION_TYPE_DEFAULT,
+				 PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	png_write_image(png, sample->rows);
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+}
+
+void free_sample(struct Sample *sample) {
+	free(sample->pixels);
+	free(sample->rows);
+	free(sample->png);
+}
+
+/* the stages which can be run on their own */
+enum Stage { DECODE, CONVERT, PALETTE, TILEIZE, EMIT, STAGES };
+const char *stage_names[STAGES] = {
+	"decode", "convert", "palette", "tileize", "emit"};
+
+/* runs one stage once over a sample */
+void run_stage(int stage,
+			   struct Sample *sample,
+			   struct Image *image,
+			   struct png2gba_palette *palette,
+			   FILE *out,
+			   char *buffer) {
+	int count = sample->width * sample->height;
+	int i;
+	struct Emitter emitter;
+	struct Outputs outputs;
+	struct Image *decoded;
+	enum png2gba_error error;
+	memset(&outputs, 0, sizeof(outputs));
+	outputs.data = out;
+	outputs.buffer = buffer;
+
+	switch (stage) {
+		case DECODE:
+			error = png2gba_read_png(sample->png, sample->png_size, &decoded);
+			if (error) {
+				fprintf(stderr,
+						"Error: Could not read PNG file: %s!\n",
+						png2gba_error_messages[error]);
+				exit(-1);
+			}
+			png2gba_free_image(decoded);
+			break;
+
+		case CONVERT:
+			for (i = 0; i < sample->height; i++) {
+				png2gba_rgb_to_15(sample->rows[i],
+								  sample->channels,
+								  image->colors + i * sample->width,
+								  sample->width);
+			}
+			break;
+
+		case PALETTE:
+			memset(palette, 0, sizeof(struct png2gba_palette));
+			palette->max = PALETTE_MAX;
+			png2gba_insert_palette(png2gba_hex24_to_15("#ff00ff"), palette);
+			for (i = 0; i < count; i++) {
+				image->indices[i] =
+					png2gba_insert_palette(image->colors[i], palette);
+			}
+			break;
+
+		case TILEIZE:
+			png2gba_tileize_8(image->indices,
+							  sample->width,
+							  sample->width,
+							  sample->height,
+							  image->ordered);
+			break;
+
+		case EMIT:
+			png2gba_emit_begin(
+				&emitter, &outputs, outputs.data, 1, "bench", "data");
+			for (i = 0; i < count; i++) {
+				png2gba_emit_value(&emitter,
+								   ((unsigned char *)image->ordered)[i]);
+			}
+			png2gba_emit_end(&emitter);
+			break;
+	}
+}
+
+/* times every stage on one sample, printing a line of throughputs */
+void bench_sample(struct Sample *sample, FILE *out, char *buffer) {
+	struct Image image;
+	memset(&image, 0, sizeof(image));
+	image.width = sample->width;
+	image.height = sample->height;
+	png2gba_alloc_work(&image, sample->height);
+	struct png2gba_palette *palette = malloc(sizeof(struct png2gba_palette));
+
+	printf("%5dx%-5d %5d colors %d ch %8zu bytes",
+		   sample->width,
+		   sample->height,
+		   sample->colors,
+		   sample->channels,
+		   sample->png_size);
+
+	int stage;
+	for (stage = 0; stage < STAGES; stage++) {
+		/* stages which need the palette only work on paletted samples */
+		if (stage >= PALETTE && sample->colors > PALETTE_MAX - 1) {
+			printf(" %10s", "-");
+			continue;
+		}
+
+		int runs = 0;
+		double start = now(), elapsed;
+		do {
+			run_stage(stage, sample, &image, palette, out, buffer);
+			runs++;
+			elapsed = now() - start;
+		} while (elapsed < BENCH_TIME);
+
+		double pixels = (double)sample->width * sample->height * runs;
+		printf(" %10.1f", pixels / elapsed / 1e6);
+	}
+	printf("\n");
+
+	free(palette);
+	png2gba_free_rows(&image);
+}
+
+int main(void) {
+	static const int sizes[] = {64, 256, 1024};
+	static const struct {
+		int channels, colors;
+	} kinds[] = {{4, 16}, {3, 255}, {3, 4096}};
+
+	FILE *out = fopen("/dev/null", "w");
+	char *buffer = malloc(OUTPUT_BUFFER_SIZE);
+
+	printf("%-36s", "image");
+	int stage;
+	for (stage = 0; stage < STAGES; stage++) {
+		printf(" %10s", stage_names[stage]);
+	}
+	printf("\n%-36s", "");
+	for (stage = 0; stage < STAGES; stage++) {
+		printf(" %10s", "Mpix/s");
+	}
+	printf("\n");
+
+	unsigned int s, k;
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+			struct Sample sample;
+			make_sample(&sample,
+						sizes[s],
+						sizes[s],
+						kinds[k].channels,
+						kinds[k].colors);
+			bench_sample(&sample, out, buffer);
+			free_sample(&sample);
+		}
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	printf("peak RSS: %ld KiB\n", usage.ru_maxrss / 1024);
+#else
+	printf("peak RSS: %ld KiB\n", usage.ru_maxrss);
+#endif
+
+	free(buffer);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,3122 @@
+/* The png2gba library: decoding pngs, building palettes, putting images
+ * in tile order and writing them out as arrays, see png2gba.h */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "png2gba_internal.h"
+
+#if defined(PNG2GBA_LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* the most colors banks can hold between them, less the transparent
+ * ones, and the words in a bitset with a bit for each */
+#define BANK_COLOR_MAX (BANK_MAX * (BANK_SIZE - 1))
+#define COLOR_SET_WORDS 4
+
+/* slots in the tile hash index, a power of two well above MAP_TILE_MAX */
+#define TILE_TABLE_SIZE 4096
+
+/* alignment of the work buffers and of each one within them */
+#define WORK_ALIGN 64
+
+const char *png2gba_error_messages[PNG2GBA_ERRORS] = {
+	"No error",
+	"Can not open it for reading",
+	"File name should end in .png",
+	"This does not seem to be a valid PNG file",
+	"Could not read PNG file",
+	"Could not allocate image",
+	"Too many colors in image for the palette",
+	"Too many colors in image for the palette banks",
+	"A tile has more than 15 colors for a palette bank",
+	"The tiles' colors don't fit in the palette banks",
+	"Too many unique tiles for the map",
+	"Must be a multiple of 8 pixels in each dimension to tileize",
+	"Must be a multiple of 256 pixels in each dimension to split into "
+	"screenblocks",
+	"Must be 128x128, 256x256, 512x512 or 1024x1024 for an affine map",
+	"Must be a multiple of the frame size to slice into frames",
+	"Data is too big to compress",
+	"Can not open an output for writing",
+	"Can not write an output",
+	"Palette must be 16 or 256 colors",
+	"The colorkey must be #rrggbb",
+	"Removing duplicate tiles needs the image tileized (-t)",
+	"Removing duplicate tiles needs a palette (-p)",
+	"Frames can not have their duplicate tiles removed",
+	"Frames can not be compressed (-z)",
+	"Map layout must be rows, screen or affine",
+	"Laying out a map needs duplicate tiles removed (-d)",
+	"An affine map needs 256 color tiles (-p)",
+	"Palette banks must be from 1 to 16",
+	"Palette banks need duplicate tiles removed (-d)",
+	"Palette banks need 16 color tiles (-p16)",
+	"Palette banks can't be shared, fixed (-s, -P) or quantized",
+	"Frames must be a sprite size, from 8x8 to 64x64",
+	"Frames need the image tileized (-t)",
+	"A shared or fixed palette needs a palette (-p)",
+	"Quantizing must be off, on or dithered",
+	"Quantizing needs a palette (-p)",
+	"A shared palette can not be quantized",
+	"Compression must be lz77, rle, huff4 or huff8",
+	"A source file can only be written alongside a header, not with -b"};
+
+const char *png2gba_timer_names[TIMERS] = {"decode",
+											"convert",
+											"palette",
+											"write"};
+
+/* seconds on a clock which only goes forward */
+double png2gba_stats_clock(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/* when a stage starts, only reading the clock if stats are kept */
+double png2gba_stats_start(struct Stats *stats) {
+	return stats ? png2gba_stats_clock() : 0;
+}
+
+/* charge the time since start to a stage, if stats are being kept */
+static void stats_add(struct Stats *stats, enum Timer timer, double start) {
+	if (stats) {
+		stats->seconds[timer] += png2gba_stats_clock() - start;
+	}
+}
+
+#if defined(__ARM_NEON)
+/* packs 16 pixels worth of separated channels into 15-bit colors */
+static inline void store_15_neon(unsigned short *dst,
+								 uint8x16_t red,
+								 uint8x16_t green,
+								 uint8x16_t blue) {
+	red = vshrq_n_u8(red, 3);
+	green = vshrq_n_u8(green, 3);
+	blue = vshrq_n_u8(blue, 3);
+
+	uint16x8_t low = vmovl_u8(vget_low_u8(red));
+	low = vorrq_u16(low, vshlq_n_u16(vmovl_u8(vget_low_u8(green)), 5));
+	low = vorrq_u16(low, vshlq_n_u16(vmovl_u8(vget_low_u8(blue)), 10));
+	uint16x8_t high = vmovl_u8(vget_high_u8(red));
+	high = vorrq_u16(high, vshlq_n_u16(vmovl_u8(vget_high_u8(green)), 5));
+	high = vorrq_u16(high, vshlq_n_u16(vmovl_u8(vget_high_u8(blue)), 10));
+
+	vst1q_u16(dst, low);
+	vst1q_u16(dst + 8, high);
+}
+#elif defined(__SSE2__)
+/* converts four 32-bit pixels laid out as R, G, B, unused bytes into
+ * 15-bit colors, one per 32-bit lane */
+static inline __m128i to_15_sse2(__m128i pixels) {
+	__m128i red = _mm_and_si128(_mm_srli_epi32(pixels, 3),
+								_mm_set1_epi32(0x001F));
+	__m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 6),
+								  _mm_set1_epi32(0x03E0));
+	__m128i blue = _mm_and_si128(_mm_srli_epi32(pixels, 9),
+								 _mm_set1_epi32(0x7C00));
+	return _mm_or_si128(red, _mm_or_si128(green, blue));
+}
+#endif
+
+#if defined(__AVX2__) && !defined(__ARM_NEON)
+/* the same as to_15_sse2, eight pixels at a time */
+static inline __m256i to_15_avx2(__m256i pixels) {
+	__m256i red = _mm256_and_si256(_mm256_srli_epi32(pixels, 3),
+								   _mm256_set1_epi32(0x001F));
+	__m256i green = _mm256_and_si256(_mm256_srli_epi32(pixels, 6),
+									 _mm256_set1_epi32(0x03E0));
+	__m256i blue = _mm256_and_si256(_mm256_srli_epi32(pixels, 9),
+									_mm256_set1_epi32(0x7C00));
+	return _mm256_or_si256(red, _mm256_or_si256(green, blue));
+}
+#endif
+
+/* converts count RGB or RGBA pixels into 15-bit GBA colors, using the
+ * widest vector instructions the build targets with a scalar loop for
+ * whatever is left over, dst may be src as each color is written
+ * behind the pixels still to be read */
+void png2gba_rgb_to_15(const png_byte *src,
+					   int channels,
+					   unsigned short *dst,
+					   int count) {
+	int i = 0;
+
+#if defined(__ARM_NEON)
+	if (channels == 4) {
+		for (; i + 16 <= count; i += 16) {
+			uint8x16x4_t pixels = vld4q_u8(src + i * 4);
+			store_15_neon(dst + i, pixels.val[0], pixels.val[1], pixels.val[2]);
+		}
+	} else {
+		for (; i + 16 <= count; i += 16) {
+			uint8x16x3_t pixels = vld3q_u8(src + i * 3);
+			store_15_neon(dst + i, pixels.val[0], pixels.val[1], pixels.val[2]);
+		}
+	}
+#elif defined(__SSE2__)
+	if (channels == 4) {
+#if defined(__AVX2__)
+		for (; i + 16 <= count; i += 16) {
+			__m256i first =
+				to_15_avx2(_mm256_loadu_si256((const __m256i *)(src + i * 4)));
+			__m256i second = to_15_avx2(
+				_mm256_loadu_si256((const __m256i *)(src + i * 4 + 32)));
+
+			/* packing works within 128-bit lanes, so put them back in order */
+			__m256i packed = _mm256_packs_epi32(first, second);
+			packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256((__m256i *)(dst + i), packed);
+		}
+#endif
+		for (; i + 8 <= count; i += 8) {
+			__m128i first =
+				to_15_sse2(_mm_loadu_si128((const __m128i *)(src + i * 4)));
+			__m128i second = to_15_sse2(
+				_mm_loadu_si128((const __m128i *)(src + i * 4 + 16)));
+			_mm_storeu_si128((__m128i *)(dst + i),
+							 _mm_packs_epi32(first, second));
+		}
+	}
+#if defined(__SSSE3__)
+	else {
+		/* spread four 3-byte pixels out into 32-bit lanes, each load reads
+		 * 16 bytes but only uses 12 so stop early enough to stay in the row */
+		const __m128i spread =
+			_mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		for (; i + 10 <= count; i += 8) {
+			__m128i first = to_15_sse2(_mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(src + i * 3)), spread));
+			__m128i second = to_15_sse2(_mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(src + i * 3 + 12)), spread));
+			_mm_storeu_si128((__m128i *)(dst + i),
+							 _mm_packs_epi32(first, second));
+		}
+	}
+#endif
+#endif
+
+	for (; i < count; i++) {
+		const png_byte *ptr = src + i * channels;
+		unsigned char red = ptr[0];
+		unsigned char green = ptr[1];
+		unsigned char blue = ptr[2];
+
+		/* convert to 16-bit color */
+		unsigned short color = (blue >> 3) << 10;
+		color += (green >> 3) << 5;
+		color += (red >> 3);
+		dst[i] = color;
+	}
+}
+
+/* hands libpng the next length bytes of the file straight out of
+ * memory */
+static void read_memory(png_structp png, png_bytep out, png_size_t length) {
+	struct PngReader *reader = png_get_io_ptr(png);
+	if (length > reader->size - reader->offset) {
+		png_error(png, "Read past the end of the file");
+	}
+	memcpy(out, reader->data + reader->offset, length);
+	reader->offset += length;
+}
+
+/* keeps libpng's reason for failing instead of printing it, and jumps
+ * back to whichever setjmp is waiting */
+static void record_error(png_structp png, png_const_charp message) {
+	struct PngReader *reader = png_get_error_ptr(png);
+	snprintf(reader->message, sizeof(reader->message), "%s", message);
+	png_longjmp(png, 1);
+}
+
+/* libpng's warnings are about pngs it can still read, so they are
+ * dropped rather than printed into the caller's stderr */
+static void ignore_warning(png_structp png, png_const_charp message) {
+	(void)png;
+	(void)message;
+}
+
+/* the last of libpng's transforms, which turns each row into 15-bit
+ * colors in place as it is decoded so the pixels are only walked once,
+ * that time is taken out of decoding */
+static void decode_row(png_structp png,
+					   png_row_infop row_info,
+					   png_bytep data) {
+	struct PngReader *reader = png_get_user_transform_ptr(png);
+	double start = png2gba_stats_start(reader->stats);
+	png2gba_rgb_to_15(
+		data, row_info->channels, (unsigned short *)data, row_info->width);
+	if (reader->stats) {
+		double seconds = png2gba_stats_clock() - start;
+		reader->stats->seconds[TIMER_CONVERT] += seconds;
+		reader->stats->seconds[TIMER_DECODE] -= seconds;
+	}
+}
+
+/* the user transform for indexed rows, moving the indices to where
+ * their colors are in the GBA palette */
+static void remap_row(png_structp png, png_row_infop row_info, png_bytep data) {
+	struct PngReader *reader = png_get_user_transform_ptr(png);
+	png_uint_32 i;
+	for (i = 0; i < row_info->width; i++) {
+		data[i] = reader->remap[data[i]];
+	}
+}
+
+/* fills a palette holding only the colorkey from the PLTE of a paletted
+ * png, keeping each entry's index where it can: the colorkey's entry
+ * swaps places with entry 0, or without one everything moves up one,
+ * returns 0 leaving the palette alone if it doesn't fit */
+static int index_palette(const png_color *entries,
+						 int count,
+						 struct PngReader *reader,
+						 struct png2gba_palette *palette) {
+	int i;
+
+	unsigned short key = palette->colors[0];
+	unsigned short colors[PALETTE_MAX];
+	int key_index = -1;
+	for (i = 0; i < count; i++) {
+		colors[i] = (entries[i].blue >> 3) << 10 |
+					(entries[i].green >> 3) << 5 | (entries[i].red >> 3);
+		if (key_index < 0 && colors[i] == key) {
+			key_index = i;
+		}
+	}
+
+	int shift = key_index < 0;
+	if (count + shift > palette->max) {
+		return 0;
+	}
+	/* indices past the PLTE only come from broken pngs, they move along
+	 * with the rest onto unused entries, which are black like libpng
+	 * makes them */
+	for (i = 0; i < PALETTE_MAX; i++) {
+		reader->remap[i] = i + shift < PALETTE_MAX ? i + shift : i;
+	}
+	if (key_index > 0) {
+		reader->remap[0] = key_index;
+		reader->remap[key_index] = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		unsigned char index = reader->remap[i];
+		palette->colors[index] = colors[i];
+		if (!palette->lookup[colors[i]]) {
+			palette->lookup[colors[i]] = index + 1;
+		}
+	}
+	palette->used = count + shift;
+
+	/* the pixels only need touching if anything moved */
+	reader->remapped = key_index != 0;
+	return 1;
+}
+
+/* reads a 4-byte big-endian number out of a png */
+static inline png_uint_32 read_be32(const unsigned char *data) {
+	return (png_uint_32)data[0] << 24 | (png_uint_32)data[1] << 16 |
+		   (png_uint_32)data[2] << 8 | data[3];
+}
+
+/* finds the next chunk of a png along from offset, giving its length
+ * and where its data starts, returns 0 if there is not a whole one */
+static int next_chunk(const struct PngReader *reader,
+					  size_t offset,
+					  png_uint_32 *length,
+					  size_t *start) {
+	if (reader->size - offset < 12) {
+		return 0;
+	}
+	*length = read_be32(reader->data + offset);
+	*start = offset + 8;
+	return *length <= reader->size - offset - 12;
+}
+
+#if !defined(PNG2GBA_LIBDEFLATE)
+/* gives zlib the next run of image data, moving on to the next IDAT
+ * chunk when this one runs out, returns 0 when there are no more */
+static int feed_idat(struct PngReader *reader) {
+	png_uint_32 length;
+	size_t start;
+	while (!reader->idat_left) {
+		/* step over the crc of the chunk just finished */
+		reader->offset += 4;
+		if (!next_chunk(reader, reader->offset, &length, &start) ||
+			memcmp(reader->data + reader->offset + 4, "IDAT", 4)) {
+			return 0;
+		}
+		reader->offset = start;
+		reader->idat_left = length;
+	}
+
+	size_t count = reader->idat_left > 1 << 30 ? 1 << 30 : reader->idat_left;
+	reader->zlib.next_in = (Bytef *)reader->data + reader->offset;
+	reader->zlib.avail_in = count;
+	reader->offset += count;
+	reader->idat_left -= count;
+	return 1;
+}
+#endif
+
+/* the paeth predictor of the png filters */
+static inline int paeth(int left, int up, int corner) {
+	int p = left + up - corner;
+	int pa = abs(p - left), pb = abs(p - up), pc = abs(p - corner);
+	return pa <= pb && pa <= pc ? left : pb <= pc ? up : corner;
+}
+
+#if defined(__SSE2__)
+/* loads and stores one pixel of bpp bytes in the low lanes, a byte at
+ * a time for 3 byte pixels so that nothing goes through memory */
+static inline __m128i load_pixel(const png_byte *pixel, int bpp) {
+	int value;
+	if (bpp == 4) {
+		memcpy(&value, pixel, 4);
+	} else {
+		value = pixel[0] | pixel[1] << 8 | pixel[2] << 16;
+	}
+	return _mm_cvtsi32_si128(value);
+}
+
+static inline void store_pixel(png_bytep pixel, __m128i value, int bpp) {
+	int word = _mm_cvtsi128_si32(value);
+	if (bpp == 4) {
+		memcpy(pixel, &word, 4);
+	} else {
+		pixel[0] = word;
+		pixel[1] = word >> 8;
+		pixel[2] = word >> 16;
+	}
+}
+
+/* picks from x where mask is set and y where it isn't */
+static inline __m128i select_si128(__m128i mask, __m128i x, __m128i y) {
+	return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static inline __m128i abs_epi16(__m128i x) {
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/* the filters which depend on the pixel to the left, for 3 and 4 byte
+ * pixels, each pixel's channels are done together in one register as
+ * libpng's own sse2 filters do, returns 0 for any other filter */
+static inline int unfilter_sse2(png_byte filter,
+								png_bytep row,
+								const png_byte *previous,
+								size_t stride,
+								int bpp) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(1);
+	__m128i left = zero, corner = zero;
+	size_t i;
+	switch (filter) {
+		case 1:
+			for (i = 0; i < stride; i += bpp) {
+				left = _mm_add_epi8(load_pixel(row + i, bpp), left);
+				store_pixel(row + i, left, bpp);
+			}
+			return 1;
+		case 3:
+			/* the average rounds down, where avg_epu8 rounds up */
+			for (i = 0; i < stride; i += bpp) {
+				__m128i up = load_pixel(previous + i, bpp);
+				__m128i average =
+					_mm_sub_epi8(_mm_avg_epu8(left, up),
+								 _mm_and_si128(_mm_xor_si128(left, up), ones));
+				left = _mm_add_epi8(load_pixel(row + i, bpp), average);
+				store_pixel(row + i, left, bpp);
+			}
+			return 1;
+		case 4:
+			/* paeth in 16-bit lanes, getting |a + b - 2c| from the other
+			 * two differences */
+			for (i = 0; i < stride; i += bpp) {
+				__m128i up =
+					_mm_unpacklo_epi8(load_pixel(previous + i, bpp), zero);
+				__m128i to_left = _mm_sub_epi16(up, corner);
+				__m128i to_up = _mm_sub_epi16(left, corner);
+				__m128i pa = abs_epi16(to_left);
+				__m128i pb = abs_epi16(to_up);
+				__m128i pc = abs_epi16(_mm_add_epi16(to_left, to_up));
+				__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+				__m128i nearest = select_si128(
+					_mm_cmpeq_epi16(pa, smallest),
+					left,
+					select_si128(_mm_cmpeq_epi16(pb, smallest), up, corner));
+				__m128i pixel =
+					_mm_add_epi8(load_pixel(row + i, bpp),
+								 _mm_packus_epi16(nearest, nearest));
+				store_pixel(row + i, pixel, bpp);
+				left = _mm_unpacklo_epi8(pixel, zero);
+				corner = up;
+			}
+			return 1;
+		default:
+			return 0;
+	}
+}
+#endif
+
+/* undoes the filter of one row in place, given the unfiltered row above
+ * it, bpp is the bytes in a pixel, returns 0 if the filter is not one
+ * png has */
+static int unfilter_row(png_bytep row,
+						const png_byte *previous,
+						size_t stride,
+						int bpp) {
+	png_byte filter = row[0];
+	row++;
+	previous++;
+	size_t i;
+
+#if defined(__SSE2__)
+	/* with the pixel size known, the compiler can drop the loads and
+	 * stores down to single moves */
+	if ((bpp == 3 && unfilter_sse2(filter, row, previous, stride, 3)) ||
+		(bpp == 4 && unfilter_sse2(filter, row, previous, stride, 4))) {
+		return 1;
+	}
+#endif
+
+	switch (filter) {
+		case 0:
+			break;
+		case 1:
+			for (i = bpp; i < stride; i++) {
+				row[i] += row[i - bpp];
+			}
+			break;
+		case 2:
+			/* a plain add of the row above, which the compiler can do
+			 * a vector at a time */
+			for (i = 0; i < stride; i++) {
+				row[i] += previous[i];
+			}
+			break;
+		case 3:
+			for (i = 0; i < (size_t)bpp; i++) {
+				row[i] += previous[i] >> 1;
+			}
+			for (; i < stride; i++) {
+				row[i] += (row[i - bpp] + previous[i]) >> 1;
+			}
+			break;
+		case 4:
+			for (i = 0; i < (size_t)bpp; i++) {
+				row[i] += previous[i];
+			}
+			for (; i < stride; i++) {
+				row[i] += paeth(row[i - bpp], previous[i], previous[i - bpp]);
+			}
+			break;
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+/* the built-in decoder's side of open_png, which takes the png if it
+ * is 8-bit RGB, RGBA or paletted and not interlaced, reading the chunks
+ * up to the first IDAT, returns 0 leaving it to libpng otherwise, or -1
+ * having freed what it took if the png can't be read after all */
+static int open_simple_png(struct PngReader *reader,
+						   struct Image *image,
+						   struct png2gba_palette *palette) {
+	png_uint_32 length;
+	size_t start;
+	if (!next_chunk(reader, 8, &length, &start) || length != 13 ||
+		memcmp(reader->data + 12, "IHDR", 4)) {
+		return 0;
+	}
+	const unsigned char *header = reader->data + start;
+	png_uint_32 width = read_be32(header);
+	png_uint_32 height = read_be32(header + 4);
+	int channels = header[9] == PNG_COLOR_TYPE_RGB		  ? 3
+				   : header[9] == PNG_COLOR_TYPE_RGB_ALPHA ? 4
+				   : header[9] == PNG_COLOR_TYPE_PALETTE   ? 1
+														   : 0;
+	if (!width || !height || width > PNG_USER_WIDTH_MAX ||
+		height > PNG_USER_HEIGHT_MAX || header[8] != 8 || !channels ||
+		header[10] || header[11] || header[12]) {
+		return 0;
+	}
+
+	/* gather up the palette on the way to the image data */
+	png_color entries[PALETTE_MAX];
+	int entry_count = 0;
+	size_t offset = start + length + 4;
+	for (;;) {
+		if (!next_chunk(reader, offset, &length, &start)) {
+			return 0;
+		}
+		const unsigned char *type = reader->data + offset + 4;
+		if (!memcmp(type, "IDAT", 4)) {
+			break;
+		}
+		if (!memcmp(type, "PLTE", 4)) {
+			if (length % 3 || length / 3 > PALETTE_MAX) {
+				return 0;
+			}
+			entry_count = length / 3;
+			memcpy(entries, reader->data + start, length);
+		}
+		offset = start + length + 4;
+	}
+	if (channels == 1 && !entry_count) {
+		return 0;
+	}
+
+	image->width = width;
+	image->height = height;
+	image->color_type = header[9];
+	image->bit_depth = 8;
+	reader->interlaced = 0;
+	reader->fast = 1;
+	reader->channels = channels;
+	reader->stride = (size_t)width * channels;
+	reader->offset = start;
+	reader->idat_left = length;
+	reader->inflated = NULL;
+
+	/* indices go straight through, or become colors through the PLTE */
+	image->indexed = palette && channels == 1 &&
+					 index_palette(entries, entry_count, reader, palette);
+	reader->indices = image->indexed;
+	int i;
+	memset(reader->colors, 0, sizeof(reader->colors));
+	for (i = 0; i < entry_count; i++) {
+		png2gba_rgb_to_15(&entries[i].red, 3, &reader->colors[i], 1);
+	}
+
+	reader->lines = calloc(reader->stride + 1, 2);
+	if (!reader->lines) {
+		return -1;
+	}
+	reader->previous = reader->lines;
+	reader->line = reader->lines + reader->stride + 1;
+
+#if defined(PNG2GBA_LIBDEFLATE)
+	/* libdeflate can only inflate the whole image at once, and from one
+	 * run of bytes, so the IDATs are stuck together if there are more */
+	size_t compressed_size = 0;
+	unsigned char *compressed = NULL;
+	int ok = 1;
+	offset = reader->offset - 8;
+	while (ok && next_chunk(reader, offset, &length, &start) &&
+		   !memcmp(reader->data + offset + 4, "IDAT", 4)) {
+		unsigned char *grown = realloc(compressed, compressed_size + length);
+		ok = grown != NULL;
+		if (ok) {
+			compressed = grown;
+			memcpy(compressed + compressed_size, reader->data + start, length);
+			compressed_size += length;
+		}
+		offset = start + length + 4;
+	}
+
+	size_t inflated_size = (reader->stride + 1) * height;
+	reader->inflated = ok ? malloc(inflated_size) : NULL;
+	struct libdeflate_decompressor *decompressor =
+		reader->inflated ? libdeflate_alloc_decompressor() : NULL;
+	ok = decompressor &&
+		 libdeflate_zlib_decompress(decompressor,
+									compressed,
+									compressed_size,
+									reader->inflated,
+									inflated_size,
+									NULL) == LIBDEFLATE_SUCCESS;
+	if (decompressor) {
+		libdeflate_free_decompressor(decompressor);
+	}
+	free(compressed);
+	if (!ok) {
+		free(reader->inflated);
+		free(reader->lines);
+		return -1;
+	}
+	reader->line = reader->inflated;
+#else
+	memset(&reader->zlib, 0, sizeof(reader->zlib));
+	if (inflateInit(&reader->zlib) != Z_OK) {
+		free(reader->lines);
+		return -1;
+	}
+#endif
+	return 1;
+}
+
+/* reads the next count rows of a png taken by open_simple_png */
+static enum png2gba_error read_simple_rows(struct PngReader *reader,
+										   png_bytep *rows,
+										   int count) {
+	size_t stride = reader->stride;
+	size_t i;
+	int r;
+	for (r = 0; r < count; r++) {
+		png_bytep line = reader->line;
+#if defined(PNG2GBA_LIBDEFLATE)
+		/* every row is already there, each one follows the last */
+		reader->line += stride + 1;
+#else
+		reader->zlib.next_out = line;
+		reader->zlib.avail_out = stride + 1;
+		while (reader->zlib.avail_out) {
+			if (!reader->zlib.avail_in && !feed_idat(reader)) {
+				return PNG2GBA_ERROR_READ_PNG;
+			}
+			int result = inflate(&reader->zlib, Z_NO_FLUSH);
+			if (result == Z_STREAM_END && reader->zlib.avail_out) {
+				return PNG2GBA_ERROR_READ_PNG;
+			} else if (result != Z_OK && result != Z_STREAM_END) {
+				return PNG2GBA_ERROR_READ_PNG;
+			}
+		}
+		reader->line = reader->previous;
+#endif
+		if (!unfilter_row(line, reader->previous, stride, reader->channels)) {
+			return PNG2GBA_ERROR_READ_PNG;
+		}
+		reader->previous = line;
+
+		double start = png2gba_stats_start(reader->stats);
+		png_bytep pixels = line + 1;
+		if (reader->channels > 1) {
+			png2gba_rgb_to_15(pixels,
+							  reader->channels,
+							  (unsigned short *)rows[r],
+							  stride / reader->channels);
+		} else if (reader->indices && !reader->remapped) {
+			memcpy(rows[r], pixels, stride);
+		} else if (reader->indices) {
+			for (i = 0; i < stride; i++) {
+				rows[r][i] = reader->remap[pixels[i]];
+			}
+		} else {
+			unsigned short *colors = (unsigned short *)rows[r];
+			for (i = 0; i < stride; i++) {
+				colors[i] = reader->colors[pixels[i]];
+			}
+		}
+		if (reader->stats) {
+			double seconds = png2gba_stats_clock() - start;
+			reader->stats->seconds[TIMER_CONVERT] += seconds;
+			reader->stats->seconds[TIMER_DECODE] -= seconds;
+		}
+	}
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* open a png file held in memory and read its header information into
+ * image, the rows are left to be read with read_rows or read_image as
+ * 15-bit colors, any format of png is taken, but when palette is given
+ * and a paletted png's colors fit in it they go there instead, and the
+ * rows are read as indices into it, nothing is left to close if it
+ * fails */
+static enum png2gba_error open_png(const unsigned char *data,
+								   size_t size,
+								   struct PngReader *reader,
+								   struct Image *image,
+								   struct png2gba_palette *palette) {
+	/* check the PNG signature */
+	if (size < 8 || png_sig_cmp(data, 0, 8)) {
+		return PNG2GBA_ERROR_NOT_PNG;
+	}
+	reader->data = data;
+	reader->size = size;
+	reader->offset = 8;
+	reader->stats = NULL;
+	reader->remapped = 0;
+	reader->message[0] = '\0';
+
+	/* the common kinds of png are read without libpng */
+	reader->fast = 0;
+	int simple = open_simple_png(reader, image, palette);
+	if (simple) {
+		return simple > 0 ? PNG2GBA_ERROR_NONE : PNG2GBA_ERROR_READ_PNG;
+	}
+
+	/* setup structs for reading */
+	png_structp png_reader = png_create_read_struct(
+		PNG_LIBPNG_VER_STRING, reader, record_error, ignore_warning);
+	if (!png_reader) {
+		return PNG2GBA_ERROR_MEMORY;
+	}
+	png_infop png_info = png_create_info_struct(png_reader);
+	if (!png_info) {
+		png_destroy_read_struct(&png_reader, NULL, NULL);
+		return PNG2GBA_ERROR_MEMORY;
+	}
+	if (setjmp(png_jmpbuf(png_reader))) {
+		png_destroy_read_struct(&png_reader, &png_info, NULL);
+		return PNG2GBA_ERROR_READ_PNG;
+	}
+
+	/* read in the header information */
+	png_set_read_fn(png_reader, reader, read_memory);
+	png_set_sig_bytes(png_reader, 8);
+	png_read_info(png_reader, png_info);
+	image->width = png_get_image_width(png_reader, png_info);
+	image->height = png_get_image_height(png_reader, png_info);
+	image->color_type = png_get_color_type(png_reader, png_info);
+	image->bit_depth = png_get_bit_depth(png_reader, png_info);
+	reader->interlaced = png_get_interlace_type(png_reader, png_info) !=
+						 PNG_INTERLACE_NONE;
+	png_set_interlace_handling(png_reader);
+	reader->png = png_reader;
+	reader->info = png_info;
+
+	/* indices go straight through, one to a byte, only needing touching
+	 * if any of them moved */
+	png_colorp entries;
+	int entry_count;
+	image->indexed =
+		palette && image->color_type == PNG_COLOR_TYPE_PALETTE &&
+		png_get_PLTE(png_reader, png_info, &entries, &entry_count) &&
+		index_palette(entries, entry_count, reader, palette);
+	if (image->indexed) {
+		if (reader->remapped) {
+			png_set_read_user_transform_fn(png_reader, remap_row);
+			png_set_user_transform_info(png_reader, reader, 0, 0);
+		}
+		png_set_packing(png_reader);
+		png_read_update_info(png_reader, png_info);
+		return PNG2GBA_ERROR_NONE;
+	}
+
+	/* have libpng bring every format to 8-bit RGB, with any alpha left
+	 * alone since decode_row skips over it anyway */
+	if (image->color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_set_palette_to_rgb(png_reader);
+	}
+	if (!(image->color_type & PNG_COLOR_MASK_COLOR)) {
+		if (image->bit_depth < 8) {
+			png_set_expand_gray_1_2_4_to_8(png_reader);
+		}
+		png_set_gray_to_rgb(png_reader);
+	}
+	if (image->bit_depth == 16) {
+		png_set_strip_16(png_reader);
+	}
+
+	/* and then to one 16-bit color per pixel */
+	png_set_read_user_transform_fn(png_reader, decode_row);
+	png_set_user_transform_info(png_reader, reader, 16, 1);
+	png_read_update_info(png_reader, png_info);
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* read the next count rows of a non-interlaced png, the reader still
+ * has to be closed if it fails */
+static enum png2gba_error read_rows(struct PngReader *reader,
+									png_bytep *rows,
+									int count) {
+	if (reader->fast) {
+		return read_simple_rows(reader, rows, count);
+	}
+	if (setjmp(png_jmpbuf(reader->png))) {
+		return PNG2GBA_ERROR_READ_PNG;
+	}
+	png_read_rows(reader->png, rows, NULL, count);
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* done reading, libpng has no way to reset a read struct so it goes
+ * with the file */
+static void close_png(struct PngReader *reader) {
+	if (reader->fast) {
+#if !defined(PNG2GBA_LIBDEFLATE)
+		inflateEnd(&reader->zlib);
+#endif
+		free(reader->inflated);
+		free(reader->lines);
+		return;
+	}
+	png_destroy_read_struct(&reader->png, &reader->info, NULL);
+}
+
+/* makes room in the work buffers for count rows, only growing them
+ * when they are too small */
+enum png2gba_error png2gba_alloc_work(struct Image *image, int count) {
+	size_t pixels = (size_t)image->width * count;
+	size_t padded = (pixels + WORK_ALIGN - 1) & ~((size_t)WORK_ALIGN - 1);
+	size_t size = padded * (sizeof(unsigned short) * 2 + 1);
+	if (size > image->work_capacity) {
+		free(image->work);
+		image->work_capacity = 0;
+		if (posix_memalign((void **)&image->work, WORK_ALIGN, size)) {
+			image->work = NULL;
+			return PNG2GBA_ERROR_MEMORY;
+		}
+		image->work_capacity = size;
+	}
+
+	image->colors = (unsigned short *)image->work;
+	image->ordered = image->work + padded * sizeof(unsigned short);
+	image->indices = image->work + padded * sizeof(unsigned short) * 2;
+
+	/* decoding goes straight into the colors, or the indices */
+	if (count > image->row_capacity) {
+		png_bytep *rows = realloc(image->rows, sizeof(png_bytep) * count);
+		if (!rows) {
+			return PNG2GBA_ERROR_MEMORY;
+		}
+		image->rows = rows;
+		image->row_capacity = count;
+	}
+	int r;
+	for (r = 0; r < count; r++) {
+		image->rows[r] =
+			image->indexed
+				? image->indices + (size_t)image->width * r
+				: (png_bytep)(image->colors + (size_t)image->width * r);
+	}
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* release the rows and work buffers of an image */
+void png2gba_free_rows(struct Image *image) {
+	free(image->rows);
+	free(image->work);
+	image->rows = NULL;
+	image->work = NULL;
+	image->colors = NULL;
+	image->indices = NULL;
+	image->ordered = NULL;
+	image->row_capacity = 0;
+	image->work_capacity = 0;
+}
+
+/* release an image loaded by png2gba_read_png */
+void png2gba_free_image(struct Image *image) {
+	png2gba_free_rows(image);
+	free(image);
+}
+
+/* read all of the rows of an opened png into image, the reader still
+ * has to be closed if it fails */
+static enum png2gba_error read_image(struct PngReader *reader,
+									 struct Image *image) {
+	enum png2gba_error error = png2gba_alloc_work(image, image->height);
+	if (error) {
+		return error;
+	}
+	if (reader->fast) {
+		return read_simple_rows(reader, image->rows, image->height);
+	}
+
+	/* read the actual file */
+	if (setjmp(png_jmpbuf(reader->png))) {
+		return PNG2GBA_ERROR_READ_PNG;
+	}
+	png_read_image(reader->png, image->rows);
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* load the png image from a file held in memory into a new image, which
+ * is left NULL if it fails */
+enum png2gba_error png2gba_read_png(const unsigned char *data,
+									size_t size,
+									struct Image **image) {
+	struct PngReader reader;
+	*image = calloc(1, sizeof(struct Image));
+	if (!*image) {
+		return PNG2GBA_ERROR_MEMORY;
+	}
+	enum png2gba_error error = open_png(data, size, &reader, *image, NULL);
+	if (!error) {
+		error = read_image(&reader, *image);
+		close_png(&reader);
+	}
+	if (error) {
+		png2gba_free_image(*image);
+		*image = NULL;
+	}
+	return error;
+}
+
+/* finds the palette entry closest to a color, leaving out index 0 as
+ * that is the transparent one */
+static unsigned char nearest_color(unsigned short color,
+								   struct png2gba_palette *palette) {
+	int red = color & 0x1F;
+	int green = (color >> 5) & 0x1F;
+	int blue = (color >> 10) & 0x1F;
+
+	int best = 0, best_distance = -1;
+	int i;
+	for (i = 1; i < palette->used; i++) {
+		int dr = red - (palette->colors[i] & 0x1F);
+		int dg = green - ((palette->colors[i] >> 5) & 0x1F);
+		int db = blue - ((palette->colors[i] >> 10) & 0x1F);
+		int distance = dr * dr + dg * dg + db * db;
+		if (best_distance < 0 || distance < best_distance) {
+			best = i;
+			best_distance = distance;
+		}
+	}
+	return best;
+}
+
+/* inserts a color into a palette and returns the index, or return
+ * the existing index if the color is already there, -1 if it is full */
+int png2gba_insert_palette(unsigned short color,
+						   struct png2gba_palette* palette) {
+	/* if it is already there, return it */
+	if (palette->lookup[color]) {
+		return palette->lookup[color] - 1;
+	}
+
+	/* a fixed palette gets the closest color it has, remembered for next
+	 * time */
+	if (palette->locked) {
+		unsigned char index = nearest_color(color, palette);
+		palette->lookup[color] = index + 1;
+		return index;
+	}
+
+	/* if the palette is full, we're in trouble */
+	if (palette->used >= palette->max) {
+		return -1;
+	}
+
+	/* it was not found, so add it */
+	palette->used++;
+	palette->colors[palette->used - 1] = color;
+	palette->lookup[color] = palette->used;
+
+	/* return the index */
+	return (palette->used - 1);
+}
+
+/* one box of colors being cut down to a palette entry, a run of the
+ * distinct colors gathered for the quantizer */
+struct ColorBox {
+	int first, count;
+	long pixels;
+
+	/* the channel with the widest range and that range */
+	int channel, range;
+};
+
+/* finds the bounds of a box's colors and which channel to cut along */
+static void measure_box(struct ColorBox *box,
+						const unsigned short *colors,
+						const unsigned int *counts) {
+	int low[3] = {31, 31, 31}, high[3] = {0, 0, 0};
+	int i, c;
+	box->pixels = 0;
+	for (i = box->first; i < box->first + box->count; i++) {
+		for (c = 0; c < 3; c++) {
+			int value = (colors[i] >> (c * 5)) & 0x1F;
+			if (value < low[c]) {
+				low[c] = value;
+			}
+			if (value > high[c]) {
+				high[c] = value;
+			}
+		}
+		box->pixels += counts[colors[i]];
+	}
+
+	box->channel = 0;
+	box->range = -1;
+	for (c = 0; c < 3; c++) {
+		if (high[c] - low[c] > box->range) {
+			box->channel = c;
+			box->range = high[c] - low[c];
+		}
+	}
+}
+
+/* splits a box in two at the median pixel along its widest channel,
+ * sorting its colors by that channel with a counting sort since each
+ * channel only has 32 values, the second half is written to other */
+static void cut_box(struct ColorBox *box,
+					struct ColorBox *other,
+					unsigned short *colors,
+					unsigned short *scratch,
+					const unsigned int *counts) {
+	int shift = box->channel * 5;
+	int starts[33];
+	long weights[32];
+	int i, v;
+	memset(starts, 0, sizeof(starts));
+	memset(weights, 0, sizeof(weights));
+	for (i = box->first; i < box->first + box->count; i++) {
+		v = (colors[i] >> shift) & 0x1F;
+		starts[v + 1]++;
+		weights[v] += counts[colors[i]];
+	}
+	for (v = 0; v < 32; v++) {
+		starts[v + 1] += starts[v];
+	}
+
+	/* the cut goes after the value holding the median pixel, or the
+	 * last one before it which leaves some colors on each side */
+	long half = box->pixels / 2, seen = 0;
+	int cut = 0;
+	for (v = 0; v < 32; v++) {
+		seen += weights[v];
+		if (starts[v + 1] > 0 && starts[v + 1] < box->count) {
+			cut = v;
+			if (seen >= half) {
+				break;
+			}
+		}
+	}
+	int split = starts[cut + 1];
+
+	for (i = box->first; i < box->first + box->count; i++) {
+		v = (colors[i] >> shift) & 0x1F;
+		scratch[starts[v]++] = colors[i];
+	}
+	memcpy(colors + box->first, scratch, box->count * sizeof(*colors));
+
+	other->first = box->first + split;
+	other->count = box->count - split;
+	box->count = split;
+	measure_box(box, colors, counts);
+	measure_box(other, colors, counts);
+}
+
+/* the cube root of the palette size rounded up, which gives roughly
+ * how far apart its colors are on each channel */
+static int palette_step(int colors) {
+	int k = 1;
+	while (k * k * k < colors) {
+		k++;
+	}
+	return (32 + k - 1) / k;
+}
+
+/* fills the rest of an unlocked palette by median cut over a 15-bit
+ * histogram of the colors given, and locks it so every color maps to
+ * the nearest entry, returns 0 without touching the palette if the
+ * colors already fit, or -1 if there is no memory to quantize with */
+static int quantize_palette(const unsigned short *pixels,
+							int count,
+							struct png2gba_palette *palette) {
+	unsigned int *counts = calloc(COLOR_COUNT, sizeof(unsigned int));
+	if (!counts) {
+		return -1;
+	}
+	int i, distinct = 0;
+	for (i = 0; i < count; i++) {
+		if (!palette->lookup[pixels[i]] && !counts[pixels[i]]++) {
+			distinct++;
+		}
+	}
+
+	int space = palette->max - palette->used;
+	if (distinct <= space) {
+		free(counts);
+		return 0;
+	}
+
+	unsigned short *colors = malloc(sizeof(unsigned short) * distinct * 2);
+	if (!colors) {
+		free(counts);
+		return -1;
+	}
+	unsigned short *scratch = colors + distinct;
+	int n = 0;
+	for (i = 0; i < COLOR_COUNT; i++) {
+		if (counts[i]) {
+			colors[n++] = i;
+		}
+	}
+
+	/* keep cutting the box with the widest channel, weighted by how many
+	 * pixels it covers, until each entry has one */
+	struct ColorBox boxes[PALETTE_MAX];
+	int box_count = 1;
+	boxes[0].first = 0;
+	boxes[0].count = distinct;
+	measure_box(&boxes[0], colors, counts);
+	while (box_count < space) {
+		int best = -1;
+		double best_score = 0;
+		for (i = 0; i < box_count; i++) {
+			double score = (double)boxes[i].range * boxes[i].pixels;
+			if (boxes[i].count > 1 && score > best_score) {
+				best = i;
+				best_score = score;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		cut_box(&boxes[best], &boxes[box_count], colors, scratch, counts);
+		box_count++;
+	}
+
+	/* each entry is the pixel weighted mean of its box */
+	for (i = 0; i < box_count; i++) {
+		long sums[3] = {0, 0, 0};
+		int j, c;
+		for (j = boxes[i].first; j < boxes[i].first + boxes[i].count; j++) {
+			for (c = 0; c < 3; c++) {
+				sums[c] += (long)((colors[j] >> (c * 5)) & 0x1F) *
+						   counts[colors[j]];
+			}
+		}
+		unsigned short color = 0;
+		for (c = 0; c < 3; c++) {
+			long mean = (sums[c] + boxes[i].pixels / 2) / boxes[i].pixels;
+			color |= mean << (c * 5);
+		}
+		palette->colors[palette->used++] = color;
+		if (!palette->lookup[color]) {
+			palette->lookup[color] = palette->used;
+		}
+	}
+	palette->locked = 1;
+
+	free(colors);
+	free(counts);
+	return 1;
+}
+
+/* the 4x4 ordered dither thresholds */
+static const unsigned char bayer[4][4] = {
+	{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+
+/* nudges each color of a width wide image by its ordered dither
+ * threshold, about one palette step across, before it is mapped into
+ * the palette, colors which are exactly in the palette are left alone
+ * so the colorkey stays transparent */
+static void dither_colors(unsigned short *colors,
+						  int width,
+						  int height,
+						  const struct png2gba_palette *palette) {
+	int step = palette_step(palette->used - 1);
+	int offsets[16];
+	int i, x, y, c;
+	for (i = 0; i < 16; i++) {
+		offsets[i] = (2 * i + 1) * step / 32 - step / 2;
+	}
+
+	for (y = 0; y < height; y++) {
+		unsigned short *row = colors + y * width;
+		for (x = 0; x < width; x++) {
+			if (palette->lookup[row[x]]) {
+				continue;
+			}
+			int offset = offsets[bayer[y & 3][x & 3]];
+			unsigned short color = 0;
+			for (c = 0; c < 3; c++) {
+				int value = ((row[x] >> (c * 5)) & 0x1F) + offset;
+				value = value < 0 ? 0 : value > 31 ? 31 : value;
+				color |= value << (c * 5);
+			}
+			row[x] = color;
+		}
+	}
+}
+
+/* a set of colors, a bit for each of the distinct colors in an image */
+struct ColorSet {
+	unsigned long long bits[COLOR_SET_WORDS];
+};
+
+/* how many colors are in a set, or in two together */
+static int set_count(const struct ColorSet *set) {
+	int count = 0, w;
+	for (w = 0; w < COLOR_SET_WORDS; w++) {
+		count += __builtin_popcountll(set->bits[w]);
+	}
+	return count;
+}
+
+static int union_count(const struct ColorSet *a, const struct ColorSet *b) {
+	int count = 0, w;
+	for (w = 0; w < COLOR_SET_WORDS; w++) {
+		count += __builtin_popcountll(a->bits[w] | b->bits[w]);
+	}
+	return count;
+}
+
+/* the colors of one tile, and which tile it is */
+struct TileColors {
+	struct ColorSet set;
+	int count;
+	int tile;
+};
+
+/* sorts the tiles with the most colors first, with tiles using the same
+ * colors next to each other */
+static int compare_tile_colors(const void *a, const void *b) {
+	const struct TileColors *x = a, *y = b;
+	if (x->count != y->count) {
+		return y->count - x->count;
+	}
+	int order = memcmp(&x->set, &y->set, sizeof(struct ColorSet));
+	return order ? order : x->tile - y->tile;
+}
+
+/* spreads the colors of a tileized image over up to bank_count palette
+ * banks, so that every tile's colors are in one bank, filling in the
+ * palette bank by bank with the transparent color first in each, the
+ * bank of each tile in banks and its pixels' indices into that bank in
+ * indices, and how many banks were used in used
+ *
+ * each tile's colors are a bitset over the distinct colors of the image,
+ * and the tiles go with the most colors first into whichever bank has
+ * to grow the least to hold them, or a new bank if none can */
+static enum png2gba_error assign_banks(const unsigned short *colors,
+									   int width,
+									   int height,
+									   int bank_count,
+									   struct png2gba_palette *palette,
+									   unsigned char *banks,
+									   unsigned char *indices,
+									   int *used_banks) {
+	unsigned short colorkey = palette->colors[0];
+	int tiles_across = width / TILE_SIZE;
+	int tile_count = tiles_across * (height / TILE_SIZE);
+
+	/* number the distinct colors, the transparent one is in every bank
+	 * so it isn't given one */
+	unsigned char *ids = calloc(COLOR_COUNT, 1);
+	unsigned short id_colors[BANK_COLOR_MAX];
+	int id_count = 0;
+	struct TileColors *tiles = calloc(tile_count, sizeof(struct TileColors));
+	enum png2gba_error error =
+		!ids || !tiles ? PNG2GBA_ERROR_MEMORY : PNG2GBA_ERROR_NONE;
+	int x, y, i, b;
+	for (y = 0; y < height && !error; y++) {
+		for (x = 0; x < width; x++) {
+			unsigned short color = colors[y * width + x];
+			if (color == colorkey) {
+				continue;
+			}
+			if (!ids[color]) {
+				if (id_count == BANK_COLOR_MAX) {
+					error = PNG2GBA_ERROR_BANK_COLORS;
+					break;
+				}
+				id_colors[id_count] = color;
+				ids[color] = ++id_count;
+			}
+			int id = ids[color] - 1;
+			struct TileColors *tile =
+				&tiles[(y / TILE_SIZE) * tiles_across + x / TILE_SIZE];
+			tile->set.bits[id / 64] |= 1ULL << (id % 64);
+		}
+	}
+	for (i = 0; i < tile_count && !error; i++) {
+		tiles[i].tile = i;
+		tiles[i].count = set_count(&tiles[i].set);
+		if (tiles[i].count > BANK_SIZE - 1) {
+			error = PNG2GBA_ERROR_TILE_COLORS;
+		}
+	}
+	if (error) {
+		free(tiles);
+		free(ids);
+		return error;
+	}
+	qsort(tiles, tile_count, sizeof(struct TileColors), compare_tile_colors);
+
+	/* best fit, a tile with the same colors as the last goes with it */
+	struct ColorSet bank_sets[BANK_MAX];
+	int bank_sizes[BANK_MAX];
+	int used = 0, best = 0;
+	memset(bank_sets, 0, sizeof(bank_sets));
+	for (i = 0; i < tile_count; i++) {
+		if (!i || memcmp(&tiles[i].set,
+						 &tiles[i - 1].set,
+						 sizeof(struct ColorSet))) {
+			int grown = BANK_SIZE;
+			for (b = 0; b < used; b++) {
+				int size = union_count(&bank_sets[b], &tiles[i].set);
+				if (size < BANK_SIZE && size - bank_sizes[b] < grown) {
+					grown = size - bank_sizes[b];
+					best = b;
+				}
+			}
+			if (grown == BANK_SIZE) {
+				if (used == bank_count) {
+					free(tiles);
+					free(ids);
+					return PNG2GBA_ERROR_BANKS;
+				}
+				best = used++;
+			}
+			int w;
+			for (w = 0; w < COLOR_SET_WORDS; w++) {
+				bank_sets[best].bits[w] |= tiles[i].set.bits[w];
+			}
+			bank_sizes[best] = set_count(&bank_sets[best]);
+		}
+		banks[tiles[i].tile] = best;
+	}
+
+	/* lay out each bank's colors, and where each color is in each bank */
+	unsigned char (*positions)[BANK_COLOR_MAX] =
+		calloc(BANK_MAX, BANK_COLOR_MAX);
+	if (!positions) {
+		free(tiles);
+		free(ids);
+		return PNG2GBA_ERROR_MEMORY;
+	}
+	memset(palette->colors, 0, sizeof(palette->colors));
+	for (b = 0; b < used; b++) {
+		int position = 0;
+		palette->colors[b * BANK_SIZE + position++] = colorkey;
+		for (i = 0; i < id_count; i++) {
+			if ((bank_sets[b].bits[i / 64] >> (i % 64)) & 1) {
+				positions[b][i] = position;
+				palette->colors[b * BANK_SIZE + position++] = id_colors[i];
+			}
+		}
+	}
+	palette->used = id_count + 1;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			unsigned short color = colors[y * width + x];
+			b = banks[(y / TILE_SIZE) * tiles_across + x / TILE_SIZE];
+			indices[y * width + x] =
+				color == colorkey ? 0 : positions[b][ids[color] - 1];
+		}
+	}
+
+	free(positions);
+	free(tiles);
+	free(ids);
+	*used_banks = used;
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* copies an image of 16-bit elements into 8x8 tile order, a row of
+ * tiles at a time so that the source rows stay in cache, the width and
+ * height must be multiples of TILE_SIZE, and the rows are stride
+ * elements apart so that part of a wider image can be done */
+static void tileize_16(const unsigned short *src,
+					   int stride,
+					   int width,
+					   int height,
+					   unsigned short *dst) {
+	int ty, tx, y;
+	for (ty = 0; ty < height; ty += TILE_SIZE) {
+		for (tx = 0; tx < width; tx += TILE_SIZE) {
+			const unsigned short *tile = src + ty * stride + tx;
+			for (y = 0; y < TILE_SIZE; y++) {
+				memcpy(dst, tile + y * stride, TILE_SIZE * sizeof(*dst));
+				dst += TILE_SIZE;
+			}
+		}
+	}
+}
+
+/* the same as tileize_16 for 8bpp palette indices, each tile row is a
+ * single 64-bit move */
+void png2gba_tileize_8(const unsigned char *src,
+					   int stride,
+					   int width,
+					   int height,
+					   unsigned char *dst) {
+	int ty, tx, y;
+	for (ty = 0; ty < height; ty += TILE_SIZE) {
+		for (tx = 0; tx < width; tx += TILE_SIZE) {
+			const unsigned char *tile = src + ty * stride + tx;
+			for (y = 0; y < TILE_SIZE; y++) {
+				memcpy(dst, tile + y * stride, TILE_SIZE);
+				dst += TILE_SIZE;
+			}
+		}
+	}
+}
+
+/* packs eight 16-color indices into one word of 4bpp data, the first
+ * pixel going in the low nibble as the GBA expects */
+static inline unsigned int pack_4(const unsigned char *indices) {
+	unsigned int word = 0;
+	int i;
+	for (i = TILE_SIZE - 1; i >= 0; i--) {
+		word = (word << 4) | (indices[i] & 0xF);
+	}
+	return word;
+}
+
+/* the same as png2gba_tileize_8 for 16-color indices, packing them to 4bpp as
+ * they are gathered so each tile row becomes one word */
+static void tileize_4(const unsigned char *src,
+					  int stride,
+					  int width,
+					  int height,
+					  unsigned int *dst) {
+	int ty, tx, y;
+	for (ty = 0; ty < height; ty += TILE_SIZE) {
+		for (tx = 0; tx < width; tx += TILE_SIZE) {
+			const unsigned char *tile = src + ty * stride + tx;
+			for (y = 0; y < TILE_SIZE; y++) {
+				*dst++ = pack_4(tile + y * stride);
+			}
+		}
+	}
+}
+
+/* the sprite sizes OAM can show, as width and height */
+static const int frame_shapes[][2] = {{8, 8},
+									  {16, 16},
+									  {32, 32},
+									  {64, 64},
+									  {16, 8},
+									  {32, 8},
+									  {32, 16},
+									  {64, 32},
+									  {8, 16},
+									  {8, 32},
+									  {16, 32},
+									  {32, 64}};
+
+/* whether width by height is one of the frame_shapes */
+int png2gba_valid_frame(int width, int height) {
+	size_t i;
+	for (i = 0; i < sizeof(frame_shapes) / sizeof(frame_shapes[0]); i++) {
+		if (frame_shapes[i][0] == width && frame_shapes[i][1] == height) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* puts an image in tile order a frame at a time, each frame row of the
+ * image going left to right and each frame holding its tiles in order,
+ * bits is 16 for colors, 8 for indices and 4 to pack indices, a frame
+ * the size of the image gives plain tile order */
+static void tileize_frames(const void *src,
+						   int bits,
+						   int width,
+						   int height,
+						   int frame_width,
+						   int frame_height,
+						   void *dst) {
+	size_t frame_bytes = (size_t)frame_width * frame_height * bits / 8;
+	int fx, fy;
+	for (fy = 0; fy < height; fy += frame_height) {
+		for (fx = 0; fx < width; fx += frame_width) {
+			size_t offset = (size_t)fy * width + fx;
+			if (bits == 16) {
+				tileize_16((const unsigned short *)src + offset,
+						   width,
+						   frame_width,
+						   frame_height,
+						   dst);
+			} else if (bits == 8) {
+				png2gba_tileize_8((const unsigned char *)src + offset,
+								  width,
+								  frame_width,
+								  frame_height,
+								  dst);
+			} else {
+				tileize_4((const unsigned char *)src + offset,
+						  width,
+						  frame_width,
+						  frame_height,
+						  dst);
+			}
+			dst = (unsigned char *)dst + frame_bytes;
+		}
+	}
+}
+
+unsigned short png2gba_hex24_to_15(const char *hex24) {
+	/* skip the # sign */
+	hex24++;
+
+	/* break off the pieces */
+	char rs[3], gs[3], bs[3];
+	rs[0] = *hex24++;
+	rs[1] = *hex24++;
+	rs[2] = '\0';
+	gs[0] = *hex24++;
+	gs[1] = *hex24++;
+	gs[2] = '\0';
+	bs[0] = *hex24++;
+	bs[1] = *hex24++;
+	bs[2] = '\0';
+
+	/* convert from hex string to int */
+	int r = strtol(rs, NULL, 16);
+	int g = strtol(gs, NULL, 16);
+	int b = strtol(bs, NULL, 16);
+
+	/* build the full 15 bit short */
+	unsigned short color = (b >> 3) << 10;
+	color += (g >> 3) << 5;
+	color += (r >> 3);
+
+	return color;
+}
+
+/* the names -z takes for each of them */
+const char *png2gba_compression_names[PNG2GBA_COMPRESSIONS] = {
+	"none", "lz77", "rle", "huff4", "huff8"};
+
+/* makes room for count more bytes, returns 0 if there is no memory
+ * for them, leaving the bytes as they were */
+static int bytes_reserve(struct Bytes *bytes, size_t count) {
+	if (bytes->used + count > bytes->capacity) {
+		size_t capacity = (bytes->used + count) * 2;
+		unsigned char *data = realloc(bytes->data, capacity);
+		if (!data) {
+			return 0;
+		}
+		bytes->data = data;
+		bytes->capacity = capacity;
+	}
+	return 1;
+}
+
+/* starts a compressed stream with the BIOS header, the type in the top
+ * nibble of the first byte and the decompressed size in the other three */
+static int bytes_header(struct Bytes *bytes, int type, size_t size) {
+	if (!bytes_reserve(bytes, 4)) {
+		return 0;
+	}
+	bytes->data[bytes->used++] = type;
+	bytes->data[bytes->used++] = size & 0xFF;
+	bytes->data[bytes->used++] = (size >> 8) & 0xFF;
+	bytes->data[bytes->used++] = (size >> 16) & 0xFF;
+	return 1;
+}
+
+/* the BIOS reads compressed data a word at a time */
+static int bytes_align(struct Bytes *bytes) {
+	if (!bytes_reserve(bytes, 3)) {
+		return 0;
+	}
+	while (bytes->used & 3) {
+		bytes->data[bytes->used++] = 0;
+	}
+	return 1;
+}
+
+/* LZ77 matches are 3 to 18 bytes, up to 4096 bytes back */
+#define LZ_MIN 3
+#define LZ_MAX 18
+#define LZ_WINDOW 4096
+
+/* buckets in the hash of the next three bytes, and how many earlier
+ * positions are tried before settling for the best so far */
+#define LZ_HASH_BITS 13
+#define LZ_CHAIN 64
+
+/* the hash chain bucket of the three bytes at data */
+static inline unsigned int lz_hash(const unsigned char *data) {
+	unsigned int key = data[0] << 16 | data[1] << 8 | data[2];
+	return (key * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* LZ77 for SWI 0x11 and 0x12, greedy over a hash chain of where each
+ * three bytes were seen, matches are never from the byte right before
+ * since VRAM is written a halfword at a time, returns 0 if it runs out
+ * of memory */
+static int compress_lz77(const unsigned char *data,
+						 size_t size,
+						 struct Bytes *out) {
+	int *head = malloc(sizeof(int) << LZ_HASH_BITS);
+	int *chain = malloc(sizeof(int) * LZ_WINDOW);
+	int ok = head && chain && bytes_header(out, 0x10, size);
+	size_t i;
+	for (i = 0; ok && i < (1u << LZ_HASH_BITS); i++) {
+		head[i] = -1;
+	}
+
+	size_t pos = 0, inserted = 0;
+	while (ok && pos < size) {
+		if (!bytes_reserve(out, 1 + 8 * 2)) {
+			ok = 0;
+			break;
+		}
+		size_t flags_at = out->used++;
+		unsigned char flags = 0;
+		int bit;
+		for (bit = 0; bit < 8 && pos < size; bit++) {
+			/* every position up to here goes in the chain */
+			for (; inserted < pos && inserted + LZ_MIN <= size; inserted++) {
+				unsigned int hash = lz_hash(data + inserted);
+				chain[inserted % LZ_WINDOW] = head[hash];
+				head[hash] = inserted;
+			}
+
+			size_t best = 0, best_distance = 0;
+			size_t most = size - pos < LZ_MAX ? size - pos : LZ_MAX;
+			if (most >= LZ_MIN) {
+				int candidate = head[lz_hash(data + pos)];
+				int tries = LZ_CHAIN;
+				while (candidate >= 0 && pos - candidate <= LZ_WINDOW &&
+					   tries--) {
+					size_t distance = pos - candidate;
+					if (distance >= 2) {
+						size_t length = 0;
+						while (length < most &&
+							   data[candidate + length] == data[pos + length]) {
+							length++;
+						}
+						if (length > best) {
+							best = length;
+							best_distance = distance;
+							if (length == most) {
+								break;
+							}
+						}
+					}
+					candidate = chain[candidate % LZ_WINDOW];
+				}
+			}
+
+			if (best >= LZ_MIN) {
+				flags |= 0x80 >> bit;
+				out->data[out->used++] =
+					(best - LZ_MIN) << 4 | (best_distance - 1) >> 8;
+				out->data[out->used++] = (best_distance - 1) & 0xFF;
+				pos += best;
+			} else {
+				out->data[out->used++] = data[pos++];
+			}
+		}
+		out->data[flags_at] = flags;
+	}
+	ok = ok && bytes_align(out);
+
+	free(chain);
+	free(head);
+	return ok;
+}
+
+/* run length encoding for SWI 0x14 and 0x15, runs of 3 to 130 of the
+ * same byte and stretches of 1 to 128 bytes as they are, returns 0 if
+ * it runs out of memory */
+static int compress_rle(const unsigned char *data,
+						size_t size,
+						struct Bytes *out) {
+	if (!bytes_header(out, 0x30, size)) {
+		return 0;
+	}
+	size_t pos = 0, literal = 0;
+	while (pos <= size) {
+		size_t run = 1;
+		while (pos < size && pos + run < size && run < 130 &&
+			   data[pos + run] == data[pos]) {
+			run++;
+		}
+
+		/* the stretch so far goes out before a run or at the end */
+		if (literal && (run >= 3 || pos == size || literal == 128)) {
+			if (!bytes_reserve(out, 1 + literal)) {
+				return 0;
+			}
+			out->data[out->used++] = literal - 1;
+			memcpy(out->data + out->used, data + pos - literal, literal);
+			out->used += literal;
+			literal = 0;
+		}
+		if (pos == size) {
+			break;
+		}
+
+		if (run >= 3) {
+			if (!bytes_reserve(out, 2)) {
+				return 0;
+			}
+			out->data[out->used++] = 0x80 | (run - 3);
+			out->data[out->used++] = data[pos];
+			pos += run;
+		} else {
+			literal++;
+			pos++;
+		}
+	}
+	return bytes_align(out);
+}
+
+/* a node of a Huffman tree, leaves have no children */
+struct HuffNode {
+	unsigned long count;
+	int symbol;
+	int children[2];
+};
+
+/* builds the Huffman tree of the symbols with nonzero counts into
+ * nodes, returning the root */
+static int huff_tree(const unsigned long *counts,
+					 int symbols,
+					 struct HuffNode *nodes) {
+	int n = 0, i;
+	for (i = 0; i < symbols; i++) {
+		if (counts[i]) {
+			nodes[n].count = counts[i];
+			nodes[n].symbol = i;
+			nodes[n].children[0] = nodes[n].children[1] = -1;
+			n++;
+		}
+	}
+
+	/* every tree needs two leaves */
+	for (i = 0; n < 2; i++) {
+		if (!counts[i]) {
+			nodes[n].count = 0;
+			nodes[n].symbol = i;
+			nodes[n].children[0] = nodes[n].children[1] = -1;
+			n++;
+		}
+	}
+
+	/* join the two least common until one is left */
+	char joined[PALETTE_MAX * 2];
+	memset(joined, 0, sizeof(joined));
+	int roots = n;
+	while (roots > 1) {
+		int pick[2] = {-1, -1}, p;
+		for (p = 0; p < 2; p++) {
+			for (i = 0; i < n; i++) {
+				if (!joined[i] && i != pick[0] &&
+					(pick[p] < 0 || nodes[i].count < nodes[pick[p]].count)) {
+					pick[p] = i;
+				}
+			}
+		}
+		joined[pick[0]] = joined[pick[1]] = 1;
+		nodes[n].count = nodes[pick[0]].count + nodes[pick[1]].count;
+		nodes[n].symbol = -1;
+		nodes[n].children[0] = pick[0];
+		nodes[n].children[1] = pick[1];
+		n++;
+		roots--;
+	}
+	return n - 1;
+}
+
+/* how far a node in the tree table can be from its children, in pairs */
+#define HUFF_REACH 63
+
+/* lays the tree out as the table the BIOS walks: the root and then
+ * pairs of children, each node giving how many pairs on its children
+ * are and whether they are leaves, mostly depth first to keep nodes
+ * near their children but taking any node about to be out of reach
+ * first, returns the size of the table or 0 if it can't fit */
+static int huff_table(const struct HuffNode *nodes,
+					  int root,
+					  unsigned char *table) {
+	/* nodes waiting for their children to be placed, with the pair they
+	 * are in and where their own entry is */
+	int waiting[PALETTE_MAX * 2][3];
+	int count = 1, pairs = 0;
+	waiting[0][0] = -1;
+	waiting[0][1] = root;
+	waiting[0][2] = 1;
+
+	while (count) {
+		int oldest = 0, i, c;
+		for (i = 1; i < count; i++) {
+			if (waiting[i][0] < waiting[oldest][0]) {
+				oldest = i;
+			}
+		}
+		int pick = pairs - waiting[oldest][0] - 1 >= HUFF_REACH / 2
+					   ? oldest
+					   : count - 1;
+		int parent = waiting[pick][0];
+		const struct HuffNode *node = &nodes[waiting[pick][1]];
+		int at = waiting[pick][2];
+		memmove(waiting[pick],
+				waiting[pick + 1],
+				sizeof(waiting[0]) * (count - pick - 1));
+		count--;
+
+		int offset = pairs - parent - 1;
+		if (offset > HUFF_REACH) {
+			return 0;
+		}
+		table[at] = offset;
+		for (c = 0; c < 2; c++) {
+			const struct HuffNode *child = &nodes[node->children[c]];
+			int where = 2 + pairs * 2 + c;
+			if (child->symbol >= 0) {
+				table[at] |= 0x80 >> c;
+				table[where] = child->symbol;
+			} else {
+				waiting[count][0] = pairs;
+				waiting[count][1] = node->children[c];
+				waiting[count][2] = where;
+				count++;
+			}
+		}
+		pairs++;
+	}
+
+	/* the size byte counts halfwords less one, and the bits after the
+	 * table have to start on a word */
+	int size = 2 + pairs * 2;
+	if (size & 3) {
+		table[size++] = 0;
+		table[size++] = 0;
+	}
+	table[0] = size / 2 - 1;
+	return size;
+}
+
+/* finds the code of every leaf under a node, as the path to it with
+ * the first step in the highest bit, returns 0 if any is over 32 bits */
+static int huff_codes(const struct HuffNode *nodes,
+					  int node,
+					  unsigned int code,
+					  int length,
+					  unsigned int *codes,
+					  int *lengths) {
+	if (nodes[node].symbol >= 0) {
+		codes[nodes[node].symbol] = code;
+		lengths[nodes[node].symbol] = length;
+		return 1;
+	}
+	if (length == 32) {
+		return 0;
+	}
+	return huff_codes(nodes,
+					  nodes[node].children[0],
+					  code << 1,
+					  length + 1,
+					  codes,
+					  lengths) &&
+		   huff_codes(nodes,
+					  nodes[node].children[1],
+					  code << 1 | 1,
+					  length + 1,
+					  codes,
+					  lengths);
+}
+
+/* Huffman coding for SWI 0x13 over bits wide symbols, 4 or 8, taking
+ * the low nibble of each byte first, when the tree comes out too deep
+ * or too wide for the BIOS the counts are flattened until it isn't,
+ * returns 0 if it runs out of memory */
+static int compress_huff(const unsigned char *data,
+						 size_t size,
+						 int bits,
+						 struct Bytes *out) {
+	int symbols = 1 << bits;
+	size_t count = size * 8 / bits;
+	unsigned long counts[PALETTE_MAX];
+	memset(counts, 0, sizeof(counts));
+	size_t i;
+	for (i = 0; i < count; i++) {
+		counts[bits == 8 ? data[i] : (data[i / 2] >> (i & 1) * 4) & 0xF]++;
+	}
+
+	struct HuffNode nodes[PALETTE_MAX * 2];
+	unsigned char table[PALETTE_MAX * 2 + 4];
+	unsigned int codes[PALETTE_MAX];
+	int lengths[PALETTE_MAX];
+	int table_size, shift = 0;
+	while (1) {
+		unsigned long flat[PALETTE_MAX];
+		int s;
+		for (s = 0; s < symbols; s++) {
+			flat[s] = counts[s] ? (counts[s] >> shift) | 1 : 0;
+		}
+		int root = huff_tree(flat, symbols, nodes);
+		table_size = huff_table(nodes, root, table);
+		if (table_size && huff_codes(nodes, root, 0, 0, codes, lengths)) {
+			break;
+		}
+		shift++;
+	}
+
+	if (!bytes_header(out, 0x20 | bits, size) ||
+		!bytes_reserve(out, table_size)) {
+		return 0;
+	}
+	memcpy(out->data + out->used, table, table_size);
+	out->used += table_size;
+
+	/* the codes go into words from the top bit down */
+	unsigned long long word = 0;
+	int used = 0;
+	for (i = 0; i < count; i++) {
+		int symbol = bits == 8 ? data[i] : (data[i / 2] >> (i & 1) * 4) & 0xF;
+		word = word << lengths[symbol] | codes[symbol];
+		used += lengths[symbol];
+		while (used >= 32 || (i + 1 == count && used > 0)) {
+			unsigned int bits32 = used >= 32 ? word >> (used - 32)
+											 : word << (32 - used);
+			if (!bytes_reserve(out, 4)) {
+				return 0;
+			}
+			int b;
+			for (b = 0; b < 4; b++) {
+				out->data[out->used++] = (bits32 >> (b * 8)) & 0xFF;
+			}
+			used = used >= 32 ? used - 32 : 0;
+			word &= used ? (1ULL << used) - 1 : 0;
+		}
+	}
+	return 1;
+}
+
+/* compresses size bytes of data into out, padded to a whole word, the
+ * BIOS header only has room for sizes under 16M */
+static enum png2gba_error compress_data(enum png2gba_compression compression,
+										const unsigned char *data,
+										size_t size,
+										struct Bytes *out) {
+	if (size >= 1 << 24) {
+		return PNG2GBA_ERROR_COMPRESS_SIZE;
+	}
+	int ok = 1;
+	switch (compression) {
+		case PNG2GBA_COMPRESS_LZ77:
+			ok = compress_lz77(data, size, out);
+			break;
+		case PNG2GBA_COMPRESS_RLE:
+			ok = compress_rle(data, size, out);
+			break;
+		case PNG2GBA_COMPRESS_HUFF4:
+			ok = compress_huff(data, size, 4, out);
+			break;
+		case PNG2GBA_COMPRESS_HUFF8:
+			ok = compress_huff(data, size, 8, out);
+			break;
+		default:
+			break;
+	}
+	return ok ? PNG2GBA_ERROR_NONE : PNG2GBA_ERROR_MEMORY;
+}
+
+/* the most bytes one element can take up as text */
+#define EMIT_ELEMENT_MAX 32
+
+/* the two hex digits of every byte value */
+static char hex_pairs[256][2];
+static pthread_once_t hex_pairs_once = PTHREAD_ONCE_INIT;
+
+static void init_hex_pairs(void) {
+	const char *digits = "0123456789ABCDEF";
+	int i;
+	for (i = 0; i < 256; i++) {
+		hex_pairs[i][0] = digits[i >> 4];
+		hex_pairs[i][1] = digits[i & 0xF];
+	}
+}
+
+/* write out whatever is pending */
+static void emit_flush(struct Emitter *emitter) {
+	if (emitter->used) {
+		double start = png2gba_stats_start(emitter->stats);
+		fwrite(emitter->buffer, 1, emitter->used, emitter->out);
+		stats_add(emitter->stats, TIMER_WRITE, start);
+		emitter->used = 0;
+	}
+}
+
+/* start writing the array name_suffix with elements of size bytes to
+ * out, which is one of outputs, formatting into its buffer, compressed
+ * arrays are always written as words */
+static void emit_begin_compressed(struct Emitter *emitter,
+								  struct Outputs *outputs,
+								  FILE *out,
+								  int size,
+								  const char *name,
+								  const char *suffix,
+								  enum png2gba_compression compression) {
+	pthread_once(&hex_pairs_once, init_hex_pairs);
+
+	int binary = outputs->binary;
+	char *buffer = outputs->buffer;
+	emitter->out = out;
+	emitter->binary = binary;
+	emitter->size = size;
+	emitter->column = 0;
+	emitter->buffer = buffer;
+	emitter->used = 0;
+	emitter->stats = outputs->stats;
+	emitter->compression = compression;
+	emitter->raw.data = NULL;
+	emitter->raw.used = 0;
+	emitter->raw.capacity = 0;
+	emitter->failed = 0;
+
+	if (!binary) {
+		const char *type = compression ? "int"
+						   : size == 1 ? "char"
+						   : size == 2 ? "short"
+									   : "int";
+		if (outputs->source) {
+			fprintf(outputs->header,
+					"extern const unsigned %s %s_%s [];\n\n",
+					type,
+					name,
+					suffix);
+		}
+		emitter->used = snprintf(buffer,
+								 OUTPUT_BUFFER_SIZE,
+								 "const unsigned %s %s_%s []%s = {\n",
+								 type,
+								 name,
+								 suffix,
+								 outputs->attributes ? outputs->attributes
+													 : "");
+	}
+}
+
+/* start writing an uncompressed array */
+void png2gba_emit_begin(struct Emitter *emitter,
+						struct Outputs *outputs,
+						FILE *out,
+						int size,
+						const char *name,
+						const char *suffix) {
+	emit_begin_compressed(
+		emitter, outputs, out, size, name, suffix, PNG2GBA_COMPRESS_NONE);
+}
+
+/* write the next element of the array */
+void png2gba_emit_value(struct Emitter *emitter, unsigned int value) {
+	int i;
+	if (emitter->compression) {
+		if (emitter->failed || !bytes_reserve(&emitter->raw, emitter->size)) {
+			emitter->failed = 1;
+			return;
+		}
+		for (i = 0; i < emitter->size; i++) {
+			emitter->raw.data[emitter->raw.used++] = (value >> (i * 8)) & 0xFF;
+		}
+		return;
+	}
+
+	if (emitter->used + EMIT_ELEMENT_MAX > OUTPUT_BUFFER_SIZE) {
+		emit_flush(emitter);
+	}
+	char *p = emitter->buffer + emitter->used;
+
+	if (emitter->binary) {
+		for (i = 0; i < emitter->size; i++) {
+			*p++ = (value >> (i * 8)) & 0xFF;
+		}
+		emitter->used = p - emitter->buffer;
+		return;
+	}
+
+	/* print leading space if first of line */
+	if (emitter->column == 0) {
+		memcpy(p, "    ", 4);
+		p += 4;
+	}
+
+	*p++ = '0';
+	*p++ = 'x';
+	for (i = emitter->size - 1; i >= 0; i--) {
+		memcpy(p, hex_pairs[(value >> (i * 8)) & 0xFF], 2);
+		p += 2;
+	}
+	*p++ = ',';
+	*p++ = ' ';
+
+	/* increment colors on line unless too many */
+	emitter->column++;
+	if (emitter->column >= TILE_SIZE) {
+		*p++ = '\n';
+		emitter->column = 0;
+	}
+	emitter->used = p - emitter->buffer;
+}
+
+/* finish off the array and write out the rest of it, compressing it
+ * first if it was held back, which is the only way it can fail */
+enum png2gba_error png2gba_emit_end(struct Emitter *emitter) {
+	if (emitter->compression) {
+		double start = png2gba_stats_start(emitter->stats);
+		struct Bytes packed = {NULL, 0, 0};
+		enum png2gba_error error = emitter->failed
+									   ? PNG2GBA_ERROR_MEMORY
+									   : compress_data(emitter->compression,
+													   emitter->raw.data,
+													   emitter->raw.used,
+													   &packed);
+		stats_add(emitter->stats, TIMER_WRITE, start);
+		free(emitter->raw.data);
+		if (error) {
+			free(packed.data);
+			emitter->compression = PNG2GBA_COMPRESS_NONE;
+			return error;
+		}
+
+		emitter->compression = PNG2GBA_COMPRESS_NONE;
+		emitter->size = 4;
+		size_t i;
+		for (i = 0; i < packed.used; i += 4) {
+			png2gba_emit_value(emitter,
+							   packed.data[i] | packed.data[i + 1] << 8 |
+									   packed.data[i + 2] << 16 |
+									   (unsigned int)packed.data[i + 3] << 24);
+		}
+		free(packed.data);
+	}
+
+	if (!emitter->binary) {
+		if (emitter->used + EMIT_ELEMENT_MAX > OUTPUT_BUFFER_SIZE) {
+			emit_flush(emitter);
+		}
+		memcpy(emitter->buffer + emitter->used, "\n};\n\n", 5);
+		emitter->used += 5;
+	}
+	emit_flush(emitter);
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* gives up on an array part way through, as a failed conversion does,
+ * dropping whatever was held back to be compressed */
+static void emit_discard(struct Emitter *emitter) {
+	if (emitter->compression) {
+		free(emitter->raw.data);
+		emitter->compression = PNG2GBA_COMPRESS_NONE;
+	}
+}
+
+/* the names each layout is given with -M, row by row is the default */
+const char *png2gba_map_layout_names[PNG2GBA_MAP_LAYOUTS] = {"rows",
+															 "screen",
+															 "affine"};
+
+/* the unique tiles of an image, found with a hash index over their
+ * pixels, and the map of screen entries placing them */
+struct TileSet {
+	unsigned char tiles[MAP_TILE_MAX][TILE_PIXELS];
+	int count;
+
+	/* an affine map can not flip tiles and only has room for
+	 * AFFINE_TILE_MAX of them */
+	int affine;
+
+	/* index + 1 of the tile hashed to each slot, 0 if empty */
+	unsigned short table[TILE_TABLE_SIZE];
+
+	/* the screen entry of each tile of the image in turn */
+	unsigned short *map;
+	int map_count;
+};
+
+/* hashes the palette indices of one tile */
+static unsigned int hash_tile(const unsigned char *tile) {
+	unsigned long long hash = 0;
+	int i;
+	for (i = 0; i < TILE_PIXELS; i += 8) {
+		unsigned long long word;
+		memcpy(&word, tile + i, 8);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+	}
+	return (unsigned int)(hash ^ (hash >> 29));
+}
+
+/* finds the slot a tile is in, or the empty slot it would go in */
+static int find_tile(struct TileSet *tiles, const unsigned char *tile) {
+	int slot = hash_tile(tile) & (TILE_TABLE_SIZE - 1);
+	while (tiles->table[slot]) {
+		if (!memcmp(tiles->tiles[tiles->table[slot] - 1], tile, TILE_PIXELS)) {
+			break;
+		}
+		slot = (slot + 1) & (TILE_TABLE_SIZE - 1);
+	}
+	return slot;
+}
+
+/* copies a tile mirrored left to right and/or top to bottom */
+static void flip_tile(const unsigned char *tile,
+					  int hflip,
+					  int vflip,
+					  unsigned char *flipped) {
+	int x, y;
+	for (y = 0; y < TILE_SIZE; y++) {
+		const unsigned char *row =
+			tile + (vflip ? TILE_SIZE - 1 - y : y) * TILE_SIZE;
+		for (x = 0; x < TILE_SIZE; x++) {
+			flipped[y * TILE_SIZE + x] = row[hflip ? TILE_SIZE - 1 - x : x];
+		}
+	}
+}
+
+/* adds a tile to the map, reusing an existing tile if it matches this
+ * one as is or flipped, returns nonzero if the tile is a new one which
+ * must be written out, or -1 if there is no room left for one */
+static int dedup_tile(struct TileSet *tiles, const unsigned char *tile) {
+	/* the flips a screen entry can apply, plain first */
+	static const unsigned short flips[] = {
+		0, SE_HFLIP, SE_VFLIP, SE_HFLIP | SE_VFLIP};
+	unsigned char flipped[TILE_PIXELS];
+	unsigned short entry = 0;
+	int is_new = 0;
+	int f, slot = 0;
+	int flip_count = tiles->affine ? 1 : 4;
+
+	for (f = 0; f < flip_count; f++) {
+		flip_tile(tile, flips[f] & SE_HFLIP, flips[f] & SE_VFLIP, flipped);
+		slot = find_tile(tiles, flipped);
+		if (tiles->table[slot]) {
+			entry = (tiles->table[slot] - 1) | flips[f];
+			break;
+		}
+	}
+
+	/* not there in any orientation, so add it as is */
+	if (f == flip_count) {
+		if (tiles->count >= (tiles->affine ? AFFINE_TILE_MAX : MAP_TILE_MAX)) {
+			return -1;
+		}
+		slot = find_tile(tiles, tile);
+		memcpy(tiles->tiles[tiles->count], tile, TILE_PIXELS);
+		tiles->table[slot] = ++tiles->count;
+		entry = tiles->count - 1;
+		is_new = 1;
+	}
+
+	tiles->map[tiles->map_count++] = entry;
+	return is_new;
+}
+
+/* the state of one image's conversion, carried across strips */
+struct Conversion {
+	const char *name;
+	struct Outputs *outputs;
+	struct Emitter emitter;
+
+	/* NULL when writing raw 16-bit color, a palette shared by the whole
+	 * batch is written separately */
+	struct png2gba_palette *palette;
+	int write_palette;
+	int tileize;
+
+	/* when the image has more colors than the palette, 1 cuts them down
+	 * and 2 dithers as well, only done on an image read in full */
+	int quantize;
+
+	/* NULL unless removing duplicate tiles, and how the map placing them
+	 * is laid out, in tiles across and down */
+	struct TileSet *tiles;
+	int map_layout;
+	int map_width, map_height;
+
+	/* when spreading 4bpp tiles over up to bank_max palette banks, the
+	 * bank each tile of the map uses, NULL otherwise */
+	int bank_max;
+	int bank_count;
+	unsigned char *banks;
+
+	/* the size of each sprite frame, 0 unless slicing a sheet */
+	int frame_width, frame_height;
+	int frame_count;
+
+	/* for 4bpp, the word being packed and how many pixels are in it */
+	int packed;
+	unsigned int word;
+	int nibbles;
+
+	/* NULL unless keeping stats, and then a bit for each raw color */
+	struct Stats *stats;
+	unsigned char *seen;
+};
+
+/* writes a run of palette indices, packing them eight to a word for
+ * 4bpp and carrying any left over into the next run */
+static void emit_indices(struct Conversion *conversion,
+						 const unsigned char *indices,
+						 int count) {
+	struct Emitter *emitter = &conversion->emitter;
+	int i;
+	if (!conversion->packed) {
+		for (i = 0; i < count; i++) {
+			png2gba_emit_value(emitter, indices[i]);
+		}
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		conversion->word |= (unsigned int)(indices[i] & 0xF)
+							<< (conversion->nibbles * 4);
+		if (++conversion->nibbles == TILE_SIZE) {
+			png2gba_emit_value(emitter, conversion->word);
+			conversion->word = 0;
+			conversion->nibbles = 0;
+		}
+	}
+}
+
+/* write the preamble and start the data array */
+static void png2gba_begin(struct Conversion *conversion, struct Image *image) {
+	/* write preamble stuff */
+	struct Outputs *outputs = conversion->outputs;
+	const char *name = conversion->name;
+	FILE *out = outputs->header;
+
+	if (conversion->frame_width) {
+		conversion->frame_count = (image->width / conversion->frame_width) *
+								  (image->height / conversion->frame_height);
+	}
+	conversion->map_width = image->width / TILE_SIZE;
+	conversion->map_height = image->height / TILE_SIZE;
+
+	/* binary data going to stdout has no header */
+	if (out) {
+		fprintf(out, "/* %s.h\n * generated by png2gba */\n\n", name);
+		fprintf(out, "#define %s_width %d\n", name, image->width);
+		fprintf(out, "#define %s_height %d\n\n", name, image->height);
+		if (conversion->tiles) {
+			fprintf(out,
+					"#define %s_map_width %d\n",
+					name,
+					conversion->map_width);
+			fprintf(out,
+					"#define %s_map_height %d\n\n",
+					name,
+					conversion->map_height);
+		}
+		if (conversion->map_layout == PNG2GBA_MAP_SCREENBLOCKS) {
+			fprintf(out,
+					"#define %s_screenblock_count %d\n\n",
+					name,
+					(conversion->map_width / SCREENBLOCK_SIZE) *
+						(conversion->map_height / SCREENBLOCK_SIZE));
+		}
+		if (outputs->source) {
+			fprintf(outputs->source,
+					"/* %s.c\n * generated by png2gba */\n\n"
+					"#include \"%s\"\n\n",
+					name,
+					outputs->header_name);
+		}
+		if (conversion->frame_width) {
+			fprintf(out,
+					"#define %s_frame_width %d\n",
+					name,
+					conversion->frame_width);
+			fprintf(out,
+					"#define %s_frame_height %d\n",
+					name,
+					conversion->frame_height);
+			fprintf(out,
+					"#define %s_frame_count %d\n\n",
+					name,
+					conversion->frame_count);
+		}
+	}
+
+	emit_begin_compressed(&conversion->emitter,
+						  outputs,
+						  outputs->data,
+						  conversion->packed	? 4
+						  : conversion->palette ? 1
+												: 2,
+						  name,
+						  "data",
+						  outputs->compression);
+}
+
+/* convert and write the pixels of image, which can be the whole image
+ * or just a strip of rows a multiple of TILE_SIZE high, its work
+ * buffers must have room for every pixel */
+static enum png2gba_error png2gba_pixels(struct Conversion *conversion,
+										 struct Image *image) {
+	struct Emitter *emitter = &conversion->emitter;
+	struct png2gba_palette *palette = conversion->palette;
+	struct Stats *stats = conversion->stats;
+	double start;
+
+	/* tiles are put in order one frame at a time, the whole image is one
+	 * frame unless slicing a sheet */
+	int frame_width =
+		conversion->frame_width ? conversion->frame_width : image->width;
+	int frame_height =
+		conversion->frame_height ? conversion->frame_height : image->height;
+
+	/* write color directly, or palette index, in the right order */
+	int count = image->width * image->height;
+	int i;
+	if (stats) {
+		stats->pixels += count;
+	}
+	if (conversion->seen && !image->indexed) {
+		for (i = 0; i < count; i++) {
+			conversion->seen[image->colors[i] >> 3] |=
+				1 << (image->colors[i] & 7);
+		}
+	}
+	if (!palette) {
+		const unsigned short *colors = image->colors;
+		if (conversion->tileize) {
+			tileize_frames(colors,
+						   16,
+						   image->width,
+						   image->height,
+						   frame_width,
+						   frame_height,
+						   image->ordered);
+			colors = image->ordered;
+		}
+		for (i = 0; i < count; i++) {
+			png2gba_emit_value(emitter, colors[i]);
+		}
+	} else {
+		/* indexed images were decoded straight to their indices */
+		if (conversion->banks) {
+			start = png2gba_stats_start(stats);
+			enum png2gba_error error = assign_banks(image->colors,
+													image->width,
+													image->height,
+													conversion->bank_max,
+													palette,
+													conversion->banks,
+													image->indices,
+													&conversion->bank_count);
+			stats_add(stats, TIMER_PALETTE, start);
+			if (error) {
+				return error;
+			}
+		} else if (!image->indexed) {
+			start = png2gba_stats_start(stats);
+			int quantized = 0;
+			if (conversion->quantize) {
+				quantized = quantize_palette(image->colors, count, palette);
+			}
+			if (quantized < 0) {
+				return PNG2GBA_ERROR_MEMORY;
+			}
+			if (quantized && conversion->quantize > 1) {
+				dither_colors(
+					image->colors, image->width, image->height, palette);
+			}
+			for (i = 0; i < count; i++) {
+				int index = png2gba_insert_palette(image->colors[i], palette);
+				if (index < 0) {
+					return PNG2GBA_ERROR_COLORS;
+				}
+				image->indices[i] = index;
+			}
+			stats_add(stats, TIMER_PALETTE, start);
+		}
+
+		/* 4bpp tiles can be packed as they are gathered */
+		if (conversion->tileize && conversion->packed && !conversion->tiles) {
+			unsigned int *words = image->ordered;
+			tileize_frames(image->indices,
+						   4,
+						   image->width,
+						   image->height,
+						   frame_width,
+						   frame_height,
+						   words);
+			for (i = 0; i < count / TILE_SIZE; i++) {
+				png2gba_emit_value(emitter, words[i]);
+			}
+			return PNG2GBA_ERROR_NONE;
+		}
+
+		const unsigned char *indices = image->indices;
+		if (conversion->tileize) {
+			tileize_frames(indices,
+						   8,
+						   image->width,
+						   image->height,
+						   frame_width,
+						   frame_height,
+						   image->ordered);
+			indices = image->ordered;
+		}
+
+		/* only write the tiles we haven't seen yet, tiles which only differ
+		 * by their bank are the same tile */
+		if (conversion->tiles) {
+			struct TileSet *tiles = conversion->tiles;
+			for (i = 0; i < count; i += TILE_PIXELS) {
+				int is_new = dedup_tile(tiles, indices + i);
+				if (is_new < 0) {
+					return PNG2GBA_ERROR_TILES;
+				}
+				if (is_new) {
+					emit_indices(conversion, indices + i, TILE_PIXELS);
+				}
+				if (conversion->banks) {
+					tiles->map[tiles->map_count - 1] |=
+						conversion->banks[i / TILE_PIXELS] << SE_BANK_SHIFT;
+				}
+			}
+			return PNG2GBA_ERROR_NONE;
+		}
+
+		emit_indices(conversion, indices, count);
+	}
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* writes the map one screenblock after another, left to right and then
+ * top to bottom, each one 32 rows of 32 entries, which is the order the
+ * GBA wants them in for a map wider or taller than one */
+static void emit_screenblocks(struct Conversion *conversion) {
+	const unsigned short *map = conversion->tiles->map;
+	int width = conversion->map_width;
+	int bx, by, x, y;
+	for (by = 0; by < conversion->map_height; by += SCREENBLOCK_SIZE) {
+		for (bx = 0; bx < width; bx += SCREENBLOCK_SIZE) {
+			for (y = by; y < by + SCREENBLOCK_SIZE; y++) {
+				for (x = bx; x < bx + SCREENBLOCK_SIZE; x++) {
+					png2gba_emit_value(&conversion->emitter,
+									   map[y * width + x]);
+				}
+			}
+		}
+	}
+}
+
+/* finish the data array and write the map and palette if needed */
+static enum png2gba_error png2gba_end(struct Conversion *conversion) {
+	struct Outputs *outputs = conversion->outputs;
+	struct Emitter *emitter = &conversion->emitter;
+	const char *name = conversion->name;
+	int i;
+
+	/* pad out the last word of 4bpp data */
+	if (conversion->packed && conversion->nibbles) {
+		png2gba_emit_value(emitter, conversion->word);
+	}
+
+	/* write postamble stuff */
+	enum png2gba_error error = png2gba_emit_end(emitter);
+	if (error) {
+		return error;
+	}
+
+	/* write the map of the unique tiles */
+	if (conversion->tiles) {
+		struct TileSet *tiles = conversion->tiles;
+		fprintf(outputs->header,
+				"#define %s_tile_count %d\n\n",
+				name,
+				tiles->count);
+		if (conversion->banks) {
+			fprintf(outputs->header,
+					"#define %s_bank_count %d\n\n",
+					name,
+					conversion->bank_count);
+		}
+
+		png2gba_emit_begin(emitter,
+						   outputs,
+						   outputs->map,
+						   conversion->map_layout == PNG2GBA_MAP_AFFINE ? 1 : 2,
+						   name,
+						   "map");
+		if (conversion->map_layout == PNG2GBA_MAP_SCREENBLOCKS) {
+			emit_screenblocks(conversion);
+		} else {
+			for (i = 0; i < tiles->map_count; i++) {
+				png2gba_emit_value(emitter, tiles->map[i]);
+			}
+		}
+		png2gba_emit_end(emitter);
+	}
+
+	/* write where each frame starts in the data, in bytes */
+	if (conversion->frame_width) {
+		int frame_bytes = conversion->frame_width * conversion->frame_height;
+		if (!conversion->palette) {
+			frame_bytes *= 2;
+		} else if (conversion->packed) {
+			frame_bytes /= 2;
+		}
+
+		png2gba_emit_begin(emitter,
+						   outputs,
+						   outputs->frames,
+						   4,
+						   name,
+						   "frames");
+		for (i = 0; i < conversion->frame_count; i++) {
+			png2gba_emit_value(emitter, i * frame_bytes);
+		}
+		png2gba_emit_end(emitter);
+	}
+
+	/* write the palette if needed */
+	if (conversion->write_palette) {
+		png2gba_emit_begin(emitter,
+						   outputs,
+						   outputs->palette,
+						   2,
+						   name,
+						   "palette");
+		for (i = 0; i < PALETTE_MAX; i++) {
+			png2gba_emit_value(emitter, conversion->palette->colors[i]);
+		}
+		png2gba_emit_end(emitter);
+	}
+
+	/* count the colors the image used */
+	if (conversion->stats) {
+		if (conversion->seen) {
+			for (i = 0; i < COLOR_COUNT; i++) {
+				conversion->stats->colors +=
+					(conversion->seen[i >> 3] >> (i & 7)) & 1;
+			}
+		} else {
+			conversion->stats->colors = conversion->palette->used;
+		}
+	}
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* perform the actual conversion from png to gba formats on an image
+ * which has been read in full */
+static enum png2gba_error png2gba(struct Conversion *conversion,
+								  struct Image *image) {
+	png2gba_begin(conversion, image);
+	enum png2gba_error error = png2gba_pixels(conversion, image);
+	if (error) {
+		emit_discard(&conversion->emitter);
+		return error;
+	}
+	return png2gba_end(conversion);
+}
+
+/* perform the conversion as a non-interlaced png is decoded, one strip
+ * of TILE_SIZE rows, or of a frame's height, at a time, so the whole
+ * image is never held */
+static enum png2gba_error png2gba_stream(struct Conversion *conversion,
+										 struct PngReader *reader,
+										 struct Image *image) {
+	int rows = conversion->frame_height ? conversion->frame_height : TILE_SIZE;
+	enum png2gba_error error = png2gba_alloc_work(image, rows);
+	if (error) {
+		return error;
+	}
+	struct Image strip = *image;
+	int r;
+
+	png2gba_begin(conversion, image);
+	for (r = 0; r < image->height && !error; r += rows) {
+		strip.height = image->height - r;
+		if (strip.height > rows) {
+			strip.height = rows;
+		}
+		double start = png2gba_stats_start(conversion->stats);
+		error = read_rows(reader, strip.rows, strip.height);
+		stats_add(conversion->stats, TIMER_DECODE, start);
+		if (!error) {
+			error = png2gba_pixels(conversion, &strip);
+		}
+	}
+	if (error) {
+		emit_discard(&conversion->emitter);
+		return error;
+	}
+	return png2gba_end(conversion);
+}
+
+/* checks an image's size suits what it is being converted to */
+static enum png2gba_error check_size(const struct png2gba_options *options,
+									 const struct Image *image) {
+	if (options->tileize &&
+		((image->width % TILE_SIZE) || (image->height % TILE_SIZE))) {
+		return PNG2GBA_ERROR_TILEIZE_SIZE;
+	}
+	if (options->map_layout == PNG2GBA_MAP_SCREENBLOCKS &&
+		((image->width % (SCREENBLOCK_SIZE * TILE_SIZE)) ||
+		 (image->height % (SCREENBLOCK_SIZE * TILE_SIZE)))) {
+		return PNG2GBA_ERROR_SCREENBLOCK_SIZE;
+	}
+	if (options->map_layout == PNG2GBA_MAP_AFFINE &&
+		(image->width != image->height ||
+		 image->width < AFFINE_MAP_MIN * TILE_SIZE ||
+		 image->width > AFFINE_MAP_MAX * TILE_SIZE ||
+		 (image->width & (image->width - 1)))) {
+		return PNG2GBA_ERROR_AFFINE_SIZE;
+	}
+	if (options->frame_width && ((image->width % options->frame_width) ||
+							  (image->height % options->frame_height))) {
+		return PNG2GBA_ERROR_FRAME_SIZE;
+	}
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* sets options to the defaults, 16-bit color in a C header with a
+ * magenta colorkey */
+void png2gba_defaults(struct png2gba_options *options) {
+	options->palette = 0;
+	options->tileize = 0;
+	options->dedup = 0;
+	options->map_layout = PNG2GBA_MAP_ROWS;
+	options->bank_count = 0;
+	options->frame_width = 0;
+	options->frame_height = 0;
+	options->binary = 0;
+	options->compression = PNG2GBA_COMPRESS_NONE;
+	options->quantize = 0;
+	options->colorkey = "#ff00ff";
+	options->shared_palette = NULL;
+	options->omit_palette = 0;
+	options->source = 0;
+	options->attributes = NULL;
+}
+
+/* checks that options make sense together, as the command line does
+ * before converting anything, since a conversion relies on them, such
+ * as a map only being made for a tileized image with a palette */
+enum png2gba_error png2gba_check_options(
+	const struct png2gba_options *options) {
+	const char *key = options->colorkey;
+	if (options->palette && options->palette != BANK_SIZE &&
+		options->palette != PALETTE_MAX) {
+		return PNG2GBA_ERROR_OPTION_PALETTE;
+	}
+	if (!key || key[0] != '#' || strlen(key) != 7 ||
+		strspn(key + 1, "0123456789abcdefABCDEF") != 6) {
+		return PNG2GBA_ERROR_OPTION_COLORKEY;
+	}
+	if (options->dedup && !options->tileize) {
+		return PNG2GBA_ERROR_OPTION_DEDUP_TILEIZE;
+	}
+	if (options->dedup && !options->palette) {
+		return PNG2GBA_ERROR_OPTION_DEDUP_PALETTE;
+	}
+	if (options->dedup && options->frame_width) {
+		return PNG2GBA_ERROR_OPTION_DEDUP_FRAMES;
+	}
+	if (options->frame_width &&
+		options->compression != PNG2GBA_COMPRESS_NONE) {
+		return PNG2GBA_ERROR_OPTION_FRAME_COMPRESSION;
+	}
+	if (options->map_layout < 0 || options->map_layout >= PNG2GBA_MAP_LAYOUTS) {
+		return PNG2GBA_ERROR_OPTION_MAP_LAYOUT;
+	}
+	if (options->map_layout != PNG2GBA_MAP_ROWS && !options->dedup) {
+		return PNG2GBA_ERROR_OPTION_MAP_DEDUP;
+	}
+	if (options->map_layout == PNG2GBA_MAP_AFFINE &&
+		options->palette != PALETTE_MAX) {
+		return PNG2GBA_ERROR_OPTION_AFFINE_PALETTE;
+	}
+	if (options->bank_count < 0 || options->bank_count > BANK_MAX) {
+		return PNG2GBA_ERROR_OPTION_BANK_COUNT;
+	}
+	if (options->bank_count && !options->dedup) {
+		return PNG2GBA_ERROR_OPTION_BANK_DEDUP;
+	}
+	if (options->bank_count && options->palette != BANK_SIZE) {
+		return PNG2GBA_ERROR_OPTION_BANK_PALETTE;
+	}
+	if (options->bank_count &&
+		(options->shared_palette || options->quantize)) {
+		return PNG2GBA_ERROR_OPTION_BANK_SHARED;
+	}
+	if ((options->frame_width || options->frame_height) &&
+		!png2gba_valid_frame(options->frame_width, options->frame_height)) {
+		return PNG2GBA_ERROR_OPTION_FRAME_SIZE;
+	}
+	if (options->frame_width && !options->tileize) {
+		return PNG2GBA_ERROR_OPTION_FRAME_TILEIZE;
+	}
+	if (options->shared_palette && !options->palette) {
+		return PNG2GBA_ERROR_OPTION_SHARED_PALETTE;
+	}
+	if (options->quantize < 0 || options->quantize > 2) {
+		return PNG2GBA_ERROR_OPTION_QUANTIZE;
+	}
+	if (options->quantize && !options->palette) {
+		return PNG2GBA_ERROR_OPTION_QUANTIZE_PALETTE;
+	}
+	if (options->quantize && options->shared_palette &&
+		!options->shared_palette->locked) {
+		return PNG2GBA_ERROR_OPTION_QUANTIZE_SHARED;
+	}
+	if (options->compression < 0 ||
+		options->compression >= PNG2GBA_COMPRESSIONS) {
+		return PNG2GBA_ERROR_OPTION_COMPRESSION;
+	}
+	if (options->source && options->binary) {
+		return PNG2GBA_ERROR_OPTION_SOURCE;
+	}
+	return PNG2GBA_ERROR_NONE;
+}
+
+/* whether a conversion with options makes an output of kind, there is
+ * always a header, binary outputs have the data and then the palette,
+ * map and frames as they are wanted in files of their own, and a
+ * source file can take the arrays out of the header */
+int png2gba_output_wanted(const struct png2gba_options *options,
+						  enum png2gba_output kind) {
+	switch (kind) {
+		case PNG2GBA_OUTPUT_HEADER:
+			return 1;
+		case PNG2GBA_OUTPUT_DATA:
+			return options->binary;
+		case PNG2GBA_OUTPUT_PALETTE:
+			return options->binary && options->palette &&
+				   !options->omit_palette;
+		case PNG2GBA_OUTPUT_MAP:
+			return options->binary && options->dedup;
+		case PNG2GBA_OUTPUT_FRAMES:
+			return options->binary && options->frame_width;
+		case PNG2GBA_OUTPUT_SOURCE:
+			return !options->binary && options->source;
+		default:
+			return 0;
+	}
+}
+
+/* opens a png held in memory for converting with options, checking
+ * them first, reading its header into image and checking its size
+ * suits them, after which it is written with png2gba_write and must be
+ * closed with png2gba_close, there is nothing to close if it fails */
+enum png2gba_error png2gba_open(struct Converter *converter,
+								const struct png2gba_options *options,
+								const unsigned char *data,
+								size_t size,
+								struct Image *image,
+								struct Stats *stats) {
+	enum png2gba_error error = png2gba_check_options(options);
+	if (error) {
+		return error;
+	}
+	converter->options = options;
+	converter->image = image;
+	converter->stats = stats;
+
+	/* Create Palette and insert Transparent Color, unless the batch is
+	 * building one between all of its images, a fixed palette is copied
+	 * since each conversion remembers the colors it has mapped into it */
+	struct png2gba_palette *palette = &converter->own_palette;
+	converter->palette = NULL;
+	if (options->shared_palette && !options->shared_palette->locked) {
+		converter->palette = options->shared_palette;
+	} else if (options->shared_palette) {
+		memcpy(palette,
+			   options->shared_palette,
+			   sizeof(struct png2gba_palette));
+		converter->palette = palette;
+	} else if (options->palette) {
+		memset(palette, 0, sizeof(struct png2gba_palette));
+		palette->max = options->palette;
+		png2gba_insert_palette(png2gba_hex24_to_15(options->colorkey), palette);
+		converter->palette = palette;
+	}
+
+	/* Input: Read Header */
+	double start = png2gba_stats_start(stats);
+	error = open_png(data,
+					 size,
+					 &converter->reader,
+					 image,
+					 options->shared_palette || options->bank_count
+						 ? NULL
+						 : converter->palette);
+	stats_add(stats, TIMER_DECODE, start);
+	if (error) {
+		return error;
+	}
+	converter->reader.stats = stats;
+
+	error = check_size(options, image);
+	if (error) {
+		close_png(&converter->reader);
+	}
+	return error;
+}
+
+/* converts an opened png, writing each of the outputs it wants to
+ * files, which png2gba_output_wanted says are needed, the arrays are named
+ * name and a source file includes header_name, output_buffer is where
+ * they are formatted and needs OUTPUT_BUFFER_SIZE bytes, the files are
+ * left open for the caller, who should discard them if it fails */
+enum png2gba_error png2gba_write(struct Converter *converter,
+								 const char *name,
+								 FILE **files,
+								 const char *header_name,
+								 char *output_buffer) {
+	const struct png2gba_options *options = converter->options;
+	struct Image *image = converter->image;
+	struct Stats *stats = converter->stats;
+	struct png2gba_palette *image_palette = converter->palette;
+
+	struct Outputs outputs;
+	outputs.binary = options->binary;
+	outputs.header = files[PNG2GBA_OUTPUT_HEADER];
+	if (options->binary) {
+		outputs.data = files[PNG2GBA_OUTPUT_DATA];
+		outputs.palette = files[PNG2GBA_OUTPUT_PALETTE];
+		outputs.map = files[PNG2GBA_OUTPUT_MAP];
+		outputs.frames = files[PNG2GBA_OUTPUT_FRAMES];
+	} else {
+		outputs.data = files[PNG2GBA_OUTPUT_SOURCE]
+						   ? files[PNG2GBA_OUTPUT_SOURCE]
+						   : outputs.header;
+		outputs.palette = outputs.data;
+		outputs.map = outputs.data;
+		outputs.frames = outputs.data;
+	}
+	outputs.buffer = output_buffer;
+	outputs.stats = stats;
+	outputs.compression = options->compression;
+	outputs.source = files[PNG2GBA_OUTPUT_SOURCE];
+	outputs.attributes = options->attributes;
+	outputs.header_name = header_name;
+
+	struct Conversion conversion;
+	conversion.name = name;
+	conversion.outputs = &outputs;
+	conversion.palette = image_palette;
+	conversion.write_palette = image_palette && !options->omit_palette;
+	conversion.tileize = options->tileize;
+	conversion.quantize =
+		image_palette && !options->shared_palette && !image->indexed
+			? options->quantize
+			: 0;
+	conversion.tiles =
+		options->dedup ? calloc(1, sizeof(struct TileSet)) : NULL;
+	int tile_count = (image->width / TILE_SIZE) * (image->height / TILE_SIZE);
+	if (conversion.tiles) {
+		conversion.tiles->affine = options->map_layout == PNG2GBA_MAP_AFFINE;
+		conversion.tiles->map = malloc(sizeof(unsigned short) * tile_count);
+	}
+	conversion.map_layout = options->map_layout;
+	conversion.bank_max = options->bank_count;
+	conversion.bank_count = 0;
+	conversion.banks = options->bank_count ? malloc(tile_count) : NULL;
+	conversion.frame_width = options->frame_width;
+	conversion.frame_height = options->frame_height;
+	conversion.frame_count = 0;
+	conversion.packed = options->palette == 16;
+	conversion.word = 0;
+	conversion.nibbles = 0;
+	conversion.stats = stats;
+
+	/* colors are counted as they go by, a palette can hold those of
+	 * other images, or fewer once quantized, only an indexed image's is
+	 * just its own */
+	int count_colors = stats && !image->indexed;
+	conversion.seen = count_colors ? calloc(1, COLOR_COUNT / 8) : NULL;
+	enum png2gba_error error = PNG2GBA_ERROR_NONE;
+	if ((options->dedup && (!conversion.tiles || !conversion.tiles->map)) ||
+		(options->bank_count && !conversion.banks) ||
+		(count_colors && !conversion.seen)) {
+		error = PNG2GBA_ERROR_MEMORY;
+	}
+
+	/* interlaced images have to be read in full, as do those which may
+	 * be quantized or have their tiles put in banks, the rest are
+	 * converted a strip at a time as they are read */
+	struct PngReader *reader = &converter->reader;
+	if (!error &&
+		(reader->interlaced || conversion.quantize || conversion.banks)) {
+		double start = png2gba_stats_start(stats);
+		error = read_image(reader, image);
+		stats_add(stats, TIMER_DECODE, start);
+		if (!error) {
+			error = png2gba(&conversion, image);
+		}
+	} else if (!error) {
+		error = png2gba_stream(&conversion, reader, image);
+	}
+
+	if (conversion.tiles) {
+		free(conversion.tiles->map);
+		free(conversion.tiles);
+	}
+	free(conversion.seen);
+	free(conversion.banks);
+	return error;
+}
+
+/* done with a png opened by png2gba_open */
+void png2gba_close(struct Converter *converter) {
+	close_png(&converter->reader);
+}
+
+/* frees the outputs made by png2gba_convert */
+void png2gba_free_buffers(struct png2gba_buffers *buffers) {
+	int kind;
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		free(buffers->data[kind]);
+		buffers->data[kind] = NULL;
+		buffers->size[kind] = 0;
+	}
+}
+
+/* converts a png held in memory into outputs held in memory, for
+ * programs which convert images themselves, the arrays are named name
+ * and a source file includes "name.h", each output wanted is put in
+ * buffers, to be freed with png2gba_free_buffers, or nothing is if it
+ * fails */
+enum png2gba_error png2gba_convert(const struct png2gba_options *options,
+								   const unsigned char *data,
+								   size_t size,
+								   const char *name,
+								   struct png2gba_buffers *buffers) {
+	FILE *files[PNG2GBA_OUTPUT_KINDS];
+	int kind;
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		files[kind] = NULL;
+		buffers->data[kind] = NULL;
+		buffers->size[kind] = 0;
+	}
+
+	struct Image image;
+	memset(&image, 0, sizeof(image));
+	struct Converter converter;
+	enum png2gba_error error =
+		png2gba_open(&converter, options, data, size, &image, NULL);
+	if (error) {
+		return error;
+	}
+
+	char *output_buffer = malloc(OUTPUT_BUFFER_SIZE);
+	char *header_name = malloc(strlen(name) + 3);
+	if (!output_buffer || !header_name) {
+		error = PNG2GBA_ERROR_MEMORY;
+	} else {
+		sprintf(header_name, "%s.h", name);
+	}
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS && !error; kind++) {
+		if (png2gba_output_wanted(options, kind)) {
+			files[kind] =
+				open_memstream(&buffers->data[kind], &buffers->size[kind]);
+			if (!files[kind]) {
+				error = PNG2GBA_ERROR_MEMORY;
+			}
+		}
+	}
+	if (!error) {
+		error =
+			png2gba_write(&converter, name, files, header_name, output_buffer);
+	}
+	png2gba_close(&converter);
+
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		if (files[kind] && fclose(files[kind]) && !error) {
+			error = PNG2GBA_ERROR_MEMORY;
+		}
+	}
+	if (error) {
+		png2gba_free_buffers(buffers);
+	}
+	free(header_name);
+	free(output_buffer);
+	png2gba_free_rows(&image);
+	return error;
+}
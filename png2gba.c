@@ -1,42 +1,81 @@
 /* Program to convert PNG images into C header files storing
  * arrays of data for programming the GBA */
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#define PNG_DEBUG 3
-#include <png.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
 
-/* the GBA palette has a limit of 256 colors */
-#define PALETTE_MAX 256
-
-/* the GBA always uses 8x8 tiles */
-#define TILE_SIZE 8
+#include "png2gba_internal.h"
 
 /* configuration arguments */
 struct Arguments {
-	int palette;
-	int tileize;
-	char *colorkey;
+	struct png2gba_options options;
 	char *output_file_name;
-	char *input_file_name;
+	char *symbol_name;
+	char **input_file_names;
+	int input_count;
+	int jobs;
+	struct Cache *cache;
+
+	/* the options' shared_palette is either built up as the batch goes
+	 * or loaded from palette_file_name, and written once on its own to
+	 * shared_palette_name if that is set */
+	char *palette_file_name;
+	char *shared_palette_name;
+	unsigned long long palette_hash;
+
+	/* one slot per input when --stats is given, NULL otherwise */
+	struct Stats *stats;
+	int stats_json;
+
+	/* a directory whose pngs are converted again whenever they change */
+	char *watch_directory;
+
+	/* only write outputs whose contents change, new files get file_mode */
+	int update;
+	mode_t file_mode;
 };
 
-/* image data */
-struct Image {
-	int width, height, channels;
-	png_byte color_type;
-	png_byte bit_depth;
-	png_bytep *rows;
+/* tells of a failure to convert a file, or to write one */
+void report_error(const char *file_name, enum png2gba_error error) {
+	fprintf(stderr,
+			"Error: %s: %s!\n",
+			file_name,
+			png2gba_error_messages[error]);
+}
+
+/* one worker's share of a batch, the owner takes jobs from the head
+ * and idle workers steal from the tail */
+struct WorkQueue {
+	pthread_mutex_t lock;
+	int *jobs;
+	int head, tail;
 };
 
-struct Palette {
-	unsigned short colors[PALETTE_MAX];
-	unsigned char used;
-	unsigned char max;
+/* state for one conversion thread */
+struct Worker {
+	pthread_t thread;
+	int id;
+	struct Arguments *args;
+	struct WorkQueue *queues;
+	int queue_count;
+	char *output_buffer;
+	struct Image image;
+
+	/* how many of its jobs couldn't be converted */
+	int failures;
 };
 
 char *extractFileName(const char *path) {
@@ -57,263 +96,1240 @@ char *extractFileName(const char *path) {
 	}
 }
 
-/* load the png image from a file */
-struct Image *read_png(FILE *in) {
-	/* read the PNG signature */
-	unsigned char header[8];
-	fread(header, 1, 8, in);
-	if (png_sig_cmp(header, 0, 8)) {
-		fprintf(stderr, "Error: This does not seem to be a valid PNG file!\n");
+/* an input file, mapped into memory where it can be */
+struct InputFile {
+	unsigned char *data;
+	size_t size;
+	int mapped;
+};
+
+/* allocates what the run as a whole needs, such as each worker's
+ * buffers, which it can't go on without */
+void *alloc_setup(size_t count, size_t size) {
+	void *memory = calloc(count, size);
+	if (!memory) {
+		fprintf(stderr, "Error: Could not allocate memory to start with!\n");
 		exit(-1);
 	}
+	return memory;
+}
 
-	/* setup structs for reading */
-	png_structp png_reader =
-		png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_reader) {
-		fprintf(stderr, "Error: Could not read PNG file!\n");
-		exit(-1);
+/* the file name which stands for stdin or stdout */
+int is_stdio(const char *file_name) {
+	return !strcmp(file_name, "-");
+}
+
+/* maps a whole input file into memory, falling back to reading it in
+ * where it can't be mapped, such as from a pipe on stdin, there is
+ * nothing to unmap if it fails */
+enum png2gba_error map_input(const char *file_name, struct InputFile *input) {
+	int fd =
+		is_stdio(file_name) ? dup(STDIN_FILENO) : open(file_name, O_RDONLY);
+	if (fd < 0) {
+		return PNG2GBA_ERROR_OPEN_INPUT;
 	}
-	png_infop png_info = png_create_info_struct(png_reader);
-	if (!png_info) {
-		fprintf(stderr, "Error: Could not read PNG file!\n");
-		exit(-1);
+
+	/* a file on stdin might not be at its start */
+	struct stat info;
+	input->data = NULL;
+	input->size = 0;
+	input->mapped = 0;
+	if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0 &&
+		lseek(fd, 0, SEEK_CUR) == 0) {
+		void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			input->data = data;
+			input->size = info.st_size;
+			input->mapped = 1;
+			close(fd);
+			return PNG2GBA_ERROR_NONE;
+		}
+	}
+
+	/* read it the slow way */
+	size_t capacity = 0;
+	ssize_t got;
+	enum png2gba_error error = PNG2GBA_ERROR_NONE;
+	do {
+		if (input->size == capacity) {
+			capacity = capacity ? capacity * 2 : 64 * 1024;
+			unsigned char *data = realloc(input->data, capacity);
+			if (!data) {
+				error = PNG2GBA_ERROR_MEMORY;
+				break;
+			}
+			input->data = data;
+		}
+		got = read(fd, input->data + input->size, capacity - input->size);
+		if (got > 0) {
+			input->size += got;
+		}
+	} while (got > 0);
+	close(fd);
+
+	if (!error && got < 0) {
+		error = PNG2GBA_ERROR_OPEN_INPUT;
 	}
-	if (setjmp(png_jmpbuf(png_reader))) {
-		fprintf(stderr, "Error: Could not read PNG file!\n");
+	if (error) {
+		free(input->data);
+	}
+	return error;
+}
+
+/* releases an input file */
+void unmap_input(struct InputFile *input) {
+	if (input->mapped) {
+		munmap(input->data, input->size);
+	} else {
+		free(input->data);
+	}
+}
+
+/* loads a fixed palette of up to max colors from a file, either a
+ * JASC-PAL file or a list of #rrggbb colors one per line, the first
+ * color is the transparent one */
+void load_palette(const char *file_name,
+				  int max,
+				  struct png2gba_palette *palette) {
+	FILE *in = fopen(file_name, "r");
+	if (!in) {
+		fprintf(stderr, "Error: Can not open %s for reading!\n", file_name);
 		exit(-1);
 	}
 
-	/* allocate an image */
-	struct Image *image = malloc(sizeof(struct Image));
+	memset(palette, 0, sizeof(struct png2gba_palette));
+	palette->max = max;
+
+	char line[256];
+	int jasc = 0, line_number = 0;
+	while (fgets(line, sizeof(line), in)) {
+		line_number++;
+		char *text = line + strspn(line, " \t");
+		text[strcspn(text, "\r\n")] = '\0';
+
+		/* the JASC-PAL header is the magic, a version and a count */
+		if (line_number == 1 && !strcmp(text, "JASC-PAL")) {
+			jasc = 1;
+			continue;
+		}
+		if (*text == '\0' || (jasc && line_number <= 3)) {
+			continue;
+		}
+
+		unsigned short color;
+		int r, g, b;
+		if (jasc && sscanf(text, "%d %d %d", &r, &g, &b) == 3) {
+			color = ((b >> 3) << 10) + ((g >> 3) << 5) + (r >> 3);
+		} else if (!jasc && text[0] == '#' && strlen(text) == 7 &&
+				   strspn(text + 1, "0123456789abcdefABCDEF") == 6) {
+			color = png2gba_hex24_to_15(text);
+		} else {
+			fprintf(stderr,
+					"Error: Bad color on line %d of %s!\n",
+					line_number,
+					file_name);
+			exit(-1);
+		}
 
-	/* read in the header information */
-	png_init_io(png_reader, in);
-	png_set_sig_bytes(png_reader, 8);
-	png_read_info(png_reader, png_info);
-	image->width = png_get_image_width(png_reader, png_info);
-	image->height = png_get_image_height(png_reader, png_info);
-	image->color_type = png_get_color_type(png_reader, png_info);
-	image->bit_depth = png_get_bit_depth(png_reader, png_info);
-	png_set_interlace_handling(png_reader);
-	png_read_update_info(png_reader, png_info);
+		if (palette->used >= max) {
+			fprintf(stderr,
+					"Error: Too many colors in %s for the palette!\n",
+					file_name);
+			exit(-1);
+		}
+		palette->colors[palette->used++] = color;
+		if (!palette->lookup[color]) {
+			palette->lookup[color] = palette->used;
+		}
+	}
+	fclose(in);
 
-	/* read the actual file */
-	if (setjmp(png_jmpbuf(png_reader))) {
-		fprintf(stderr, "Error: Could not read PNG file!\n");
+	if (palette->used == 0) {
+		fprintf(stderr, "Error: No colors in %s!\n", file_name);
 		exit(-1);
 	}
-	image->rows = (png_bytep *)malloc(sizeof(png_bytep) * image->height);
-	int r;
-	for (r = 0; r < image->height; r++) {
-		image->rows[r] = malloc(png_get_rowbytes(png_reader, png_info));
+	palette->locked = 1;
+}
+
+/* the suffix of each kind of output, the binary ones swap the .h of the
+ * header for theirs */
+const char *output_suffixes[PNG2GBA_OUTPUT_KINDS] = {
+	".h", ".img.bin", ".pal.bin", ".map.bin", ".frames.bin", ".c"};
+
+/* an output which can be kept in memory until it is closed, so that
+ * the file is only written if it doesn't already hold the same */
+struct HeldOutput {
+	int hold;
+	mode_t mode;
+	char *data;
+	size_t size;
+};
+
+/* writes data to a file unless it already holds exactly that, through
+ * a temporary file renamed into place so it is never seen half written
+ * and its time is left alone when nothing changed, a new file is given
+ * mode and an old one keeps its own, returns 1 if it was written, 0 if
+ * it was already the same and -1 if it couldn't be written */
+int update_file(const char *file_name,
+				const char *data,
+				size_t size,
+				mode_t mode) {
+	struct stat info;
+	if (!stat(file_name, &info) && S_ISREG(info.st_mode)) {
+		mode = info.st_mode & 07777;
+		struct InputFile existing;
+		if ((size_t)info.st_size == size &&
+			!map_input(file_name, &existing)) {
+			int same = existing.size == size &&
+					   (!size || !memcmp(existing.data, data, size));
+			unmap_input(&existing);
+			if (same) {
+				return 0;
+			}
+		}
 	}
-	png_read_image(png_reader, image->rows);
 
-	/* check format */
-	if (png_get_color_type(png_reader, png_info) == PNG_COLOR_TYPE_RGB) {
-		image->channels = 3;
-	} else if (png_get_color_type(png_reader, png_info) ==
-			   PNG_COLOR_TYPE_RGBA) {
-		image->channels = 4;
-	} else {
-		fprintf(stderr, "Error: PNG file is not in the RGB or RGBA format!\n");
-		exit(-1);
+	char *temp = malloc(strlen(file_name) + 8);
+	if (!temp) {
+		return -1;
+	}
+	sprintf(temp, "%s.XXXXXX", file_name);
+	int fd = mkstemp(temp);
+	if (fd < 0) {
+		free(temp);
+		return -1;
+	}
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t count = write(fd, data + written, size - written);
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	int failed = fchmod(fd, mode);
+	if (close(fd) || failed || written < size || rename(temp, file_name)) {
+		unlink(temp);
+		free(temp);
+		return -1;
 	}
+	free(temp);
+	return 1;
+}
 
-	return image;
+/* open a file for writing, or return NULL, - is stdout, and a held
+ * output goes to memory instead */
+FILE *open_output(const char *output_name,
+				  const char *mode,
+				  struct HeldOutput *held) {
+	if (is_stdio(output_name)) {
+		return stdout;
+	}
+	return held->hold ? open_memstream(&held->data, &held->size)
+					  : fopen(output_name, mode);
 }
 
-/* inserts a color into a palette and returns the index, or return
- * the existing index if the color is already there */
-unsigned char insert_palette(unsigned short color,
-							 struct Palette* palette) {
-	/* loop through the palette */
-	unsigned char i;
-	for (i = 0; i < palette->used; i++) {
-		/* if this is it, return it */
-		if (palette->colors[i] == color) {
-			return i;
+/* done writing a file, stdout is only flushed as there may be more to
+ * go there, a held output is only now written to its file if it has
+ * changed, when discarding a failed conversion it is dropped, or
+ * removed rather than left half written */
+enum png2gba_error close_output(FILE *output,
+								const char *output_name,
+								struct HeldOutput *held,
+								int discard) {
+	if (output == stdout) {
+		return fflush(output) ? PNG2GBA_ERROR_WRITE_OUTPUT : PNG2GBA_ERROR_NONE;
+	}
+	int failed = ferror(output);
+	failed |= fclose(output);
+	if (held->hold) {
+		if (!discard && !failed) {
+			failed = update_file(
+						 output_name, held->data, held->size, held->mode) < 0;
 		}
+		free(held->data);
+	} else if (discard || failed) {
+		unlink(output_name);
 	}
+	return failed ? PNG2GBA_ERROR_WRITE_OUTPUT : PNG2GBA_ERROR_NONE;
+}
 
-	/* if the palette is full, we're in trouble */
-	if (palette->used >= (palette->max - 1)) {
-		fprintf(stderr, "Error: Too many colors in image for the palette!\n");
-		exit(-1);
-	}
+/* how much has been written to a file, 0 if that can't be told as with
+ * a pipe */
+long output_size(FILE *output) {
+	long size = ftell(output);
+	return size < 0 ? 0 : size;
+}
 
-	/* it was not found, so add it */
-	palette->used++;
-	palette->colors[palette->used - 1] = color;
+/* builds the name of a binary output next to the header, swapping the
+ * .h extension for the suffix given */
+char *binary_output_name(const char *header_name, const char *suffix) {
+	size_t length = strlen(header_name);
+	if (length > 2 && !strcmp(header_name + length - 2, ".h")) {
+		length -= 2;
+	}
 
-	/* return the index */
-	return (palette->used - 1);
+	char *output_name = malloc(length + strlen(suffix) + 1);
+	memcpy(output_name, header_name, length);
+	strcpy(output_name + length, suffix);
+	return output_name;
 }
 
-/* returns the next pixel from the image, based on whether we
- * are tile-izing or not, returns NULL when we have done them all */
-png_byte *next_byte(struct Image *image, int tileize) {
-	/* keeps track of where we are in the "global" image */
-	static int r = 0;
-	static int c = 0;
+/* the on-disk cache of converted outputs, keyed on a hash of the input
+ * and the options it was converted with */
+struct Cache {
+	char *directory;
+	pthread_mutex_t lock;
+	int hits, misses;
+};
+
+/* creates a directory and any missing parents, like mkdir -p, returns
+ * nonzero if the directory is there afterwards */
+int make_directories(const char *directory) {
+	char *path = strdup(directory);
+	if (!path) {
+		return 0;
+	}
+	char *slash;
+	for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(path, 0777);
+		*slash = '/';
+	}
+	mkdir(path, 0777);
+	free(path);
 
-	/* keeps track of where we are relative to one tile (0-7) */
-	static int tr = 0;
-	static int tc = 0;
+	struct stat info;
+	return stat(directory, &info) == 0 && S_ISDIR(info.st_mode);
+}
 
-	/* if we have gone through it all */
-	if (r == image->height) {
-		return NULL;
+/* bump this whenever the output for the same input and options changes,
+ * so stale cache entries are not used */
+#define CACHE_VERSION 3
+
+/* a key is 16 hex digits */
+#define CACHE_KEY_SIZE 17
+
+/* 64-bit FNV-1a over a run of bytes, continuing from hash */
+unsigned long long fnv1a(unsigned long long hash,
+						 const void *data,
+						 size_t size) {
+	const unsigned char *bytes = data;
+	size_t i;
+	for (i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
 	}
+	return hash;
+}
+
+/* hashes a fixed palette for the cache key, how many colors it has as
+ * well as what they are, since unused entries are zero like black */
+unsigned long long palette_hash(const struct png2gba_palette *palette) {
+	unsigned long long hash = fnv1a(
+		0xCBF29CE484222325ULL, palette->colors, sizeof(palette->colors));
+	hash = fnv1a(hash, &palette->used, sizeof(palette->used));
+	hash = fnv1a(hash, &palette->max, sizeof(palette->max));
+	return fnv1a(hash, &palette->locked, sizeof(palette->locked));
+}
+
+/* builds the cache key for an input file, covering every byte of it as
+ * well as each option that changes the output, and with -x the name the
+ * source file includes the header by */
+void cache_key(struct InputFile *input,
+			   struct Arguments *args,
+			   const char *name,
+			   const char *header_name,
+			   char key[CACHE_KEY_SIZE]) {
+	unsigned long long hash =
+		fnv1a(0xCBF29CE484222325ULL, input->data, input->size);
+
+	char *include =
+		args->options.source ? extractFileName(header_name) : strdup("");
+	char options[512];
+	snprintf(options,
+			 sizeof(options),
+			 "%d %d %d %d %d %d %dx%d %d %d %d %d %s %s %s %s %d %016llx",
+			 CACHE_VERSION,
+			 args->options.palette,
+			 args->options.tileize,
+			 args->options.dedup,
+			 args->options.map_layout,
+			 args->options.bank_count,
+			 args->options.frame_width,
+			 args->options.frame_height,
+			 args->options.binary,
+			 args->options.compression,
+			 args->options.quantize,
+			 args->options.source,
+			 args->options.attributes ? args->options.attributes : "",
+			 args->options.colorkey,
+			 name,
+			 include,
+			 args->options.omit_palette,
+			 args->palette_hash);
+	hash = fnv1a(hash, options, strlen(options));
+	free(include);
+
+	snprintf(key, CACHE_KEY_SIZE, "%016llx", hash);
+}
+
+/* builds the path of one cached output */
+char *cache_path(struct Cache *cache, const char *key, int kind) {
+	char *path = malloc(strlen(cache->directory) + strlen(key) +
+						strlen(output_suffixes[kind]) + 2);
+	sprintf(path, "%s/%s%s", cache->directory, key, output_suffixes[kind]);
+	return path;
+}
 
-	/* get the pixel next */
-	png_byte *row = image->rows[r];
-	png_byte *ptr = &(row[c * image->channels]);
+/* copies one file to another, returns nonzero on success */
+int copy_file(const char *from, const char *to) {
+	FILE *in = fopen(from, "rb");
+	if (!in) {
+		return 0;
+	}
+	FILE *out = fopen(to, "wb");
+	if (!out) {
+		fclose(in);
+		return 0;
+	}
 
-	/* increment things based on if we are tileizing or not */
-	if (!tileize) {
-		/* just go sequentially, wrapping to the next row at the end of a column
-		 */
-		c++;
-		if (c >= image->width) {
-			r++;
-			c = 0;
+	char chunk[64 * 1024];
+	size_t size;
+	int ok = 1;
+	while ((size = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+		if (fwrite(chunk, 1, size, out) != size) {
+			ok = 0;
+			break;
 		}
+	}
+	if (ferror(in)) {
+		ok = 0;
+	}
+	fclose(in);
+	if (fclose(out)) {
+		ok = 0;
+	}
+	return ok;
+}
+
+/* counts a hit or a miss */
+void cache_count(struct Cache *cache, int hit) {
+	pthread_mutex_lock(&cache->lock);
+	if (hit) {
+		cache->hits++;
 	} else {
-		/* increment the column */
-		c++;
-		tc++;
-
-		/* if we hit the end of a tile row */
-		if (tc >= 8) {
-			/* go to the next one */
-			r++;
-			tr++;
-			c -= 8;
-			tc = 0;
-
-			/* if we hit the end of the tile altogether */
-			if (tr >= 8) {
-				r -= 8;
-				tr = 0;
-				c += 8;
-			}
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* copies every output for key out of the cache, only over the files
+ * which differ for those held, returns nonzero if they were all there */
+int cache_fetch(struct Cache *cache,
+				const char *key,
+				char **output_names,
+				const struct HeldOutput *held) {
+	int kind, hit = 1;
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS && hit; kind++) {
+		if (!output_names[kind]) {
+			continue;
+		}
+		char *path = cache_path(cache, key, kind);
+		struct InputFile cached;
+		if (!held[kind].hold) {
+			hit = copy_file(path, output_names[kind]);
+		} else if ((hit = !map_input(path, &cached))) {
+			hit = update_file(output_names[kind],
+							  (char *)cached.data,
+							  cached.size,
+							  held[kind].mode) >= 0;
+			unmap_input(&cached);
+		}
+		free(path);
+	}
+	cache_count(cache, hit);
+	return hit;
+}
 
-			/* if we are now at the end of the actual row, go to next one */
-			if (c >= image->width) {
-				tc = 0;
-				tr = 0;
-				c = 0;
-				r += 8;
+/* stores every output just written under key, each one is copied to a
+ * temporary file first and renamed into place so that other processes
+ * sharing the cache never see half an entry */
+void cache_store(struct Cache *cache, const char *key, char **output_names) {
+	int kind;
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		if (!output_names[kind]) {
+			continue;
+		}
+		char *path = cache_path(cache, key, kind);
+		char *temp = malloc(strlen(path) + 8);
+		sprintf(temp, "%s.XXXXXX", path);
+
+		int fd = mkstemp(temp);
+		if (fd >= 0) {
+			close(fd);
+			if (!copy_file(output_names[kind], temp) || rename(temp, path)) {
+				unlink(temp);
 			}
 		}
+		free(temp);
+		free(path);
+	}
+}
+
+/* adds one input file to the list to convert */
+void add_input(struct Arguments *args, const char *input_file_name) {
+	char **names = realloc(args->input_file_names,
+						   sizeof(char *) * (args->input_count + 1));
+	if (!names) {
+		fprintf(stderr, "Error: Could not allocate memory to start with!\n");
+		exit(-1);
+	}
+	args->input_file_names = names;
+	args->input_file_names[args->input_count++] = strdup(input_file_name);
+}
+
+/* reads a manifest listing one input file per line, blank lines and
+ * lines starting with # are skipped */
+void read_manifest(struct Arguments *args, const char *manifest_name) {
+	FILE *manifest = fopen(manifest_name, "r");
+	if (!manifest) {
+		fprintf(stderr,
+				"Error: Can not open %s for reading!\n",
+				manifest_name);
+		exit(-1);
+	}
+
+	char line[4096];
+	while (fgets(line, sizeof(line), manifest)) {
+		/* chop off the newline and any trailing whitespace */
+		size_t length = strlen(line);
+		while (length > 0 && strchr(" \t\r\n", line[length - 1])) {
+			line[--length] = '\0';
+		}
+		if (length == 0 || line[0] == '#') {
+			continue;
+		}
+		add_input(args, line);
 	}
+	fclose(manifest);
+}
 
-	/* and return the pixel we found previously */
-	return ptr;
+/* whether a file name is one of the pngs a directory is watched for */
+int is_png(const char *file_name) {
+	size_t length = strlen(file_name);
+	return length > 4 && !strcmp(file_name + length - 4, ".png");
 }
 
-unsigned short hex24_to_15(char *hex24) {
-	/* skip the # sign */
-	hex24++;
+/* the path of a file in a directory */
+char *directory_path(const char *directory, const char *file_name) {
+	char *path = malloc(strlen(directory) + strlen(file_name) + 2);
+	sprintf(path, "%s/%s", directory, file_name);
+	return path;
+}
 
-	/* break off the pieces */
-	char rs[3], gs[3], bs[3];
-	rs[0] = *hex24++;
-	rs[1] = *hex24++;
-	rs[2] = '\0';
-	gs[0] = *hex24++;
-	gs[1] = *hex24++;
-	gs[2] = '\0';
-	bs[0] = *hex24++;
-	bs[1] = *hex24++;
-	bs[2] = '\0';
+/* adds every png in a directory as an input, in name order so the
+ * batch comes out the same every time */
+void add_directory(struct Arguments *args, const char *directory) {
+	struct dirent **entries;
+	int count = scandir(directory, &entries, NULL, alphasort);
+	if (count < 0) {
+		fprintf(stderr, "Error: Can not read directory %s!\n", directory);
+		exit(-1);
+	}
 
-	/* convert from hex string to int */
-	int r = strtol(rs, NULL, 16);
-	int g = strtol(gs, NULL, 16);
-	int b = strtol(bs, NULL, 16);
+	int i;
+	for (i = 0; i < count; i++) {
+		if (is_png(entries[i]->d_name)) {
+			char *path = directory_path(directory, entries[i]->d_name);
+			add_input(args, path);
+			free(path);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+}
 
-	/* build the full 15 bit short */
-	unsigned short color = (b >> 3) << 10;
-	color += (g >> 3) << 5;
-	color += (r >> 3);
+/* closes each of the outputs of a conversion which is open, all of
+ * them are discarded if error says the conversion failed, returns that
+ * or the first output which couldn't be written */
+enum png2gba_error close_outputs(FILE **files,
+								 char **output_names,
+								 struct HeldOutput *held,
+								 enum png2gba_error error) {
+	int discard = error != PNG2GBA_ERROR_NONE;
+	int kind;
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		if (files[kind]) {
+			enum png2gba_error closed = close_output(
+				files[kind], output_names[kind], &held[kind], discard);
+			error = error ? error : closed;
+			files[kind] = NULL;
+		}
+	}
+	return error;
+}
 
-	return color;
+/* opens each of the outputs of a conversion which has a name, if one
+ * can't be opened then those which were are discarded again */
+enum png2gba_error open_outputs(FILE **files,
+								char **output_names,
+								struct HeldOutput *held) {
+	int kind;
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		files[kind] = NULL;
+	}
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		if (!output_names[kind]) {
+			continue;
+		}
+		int text =
+			kind == PNG2GBA_OUTPUT_HEADER || kind == PNG2GBA_OUTPUT_SOURCE;
+		files[kind] =
+			open_output(output_names[kind], text ? "w" : "wb", &held[kind]);
+		if (!files[kind]) {
+			return close_outputs(
+				files, output_names, held, PNG2GBA_ERROR_OPEN_OUTPUT);
+		}
+	}
+	return PNG2GBA_ERROR_NONE;
 }
 
-/* perform the actual conversion from png to gba formats */
-void png2gba(
-	FILE *in, FILE *out, char *name, int palette, int tileize, char *colorkey) {
+/* converts a mapped input for convert_file, its outputs are only
+ * opened once the png has been and is found to suit the options */
+enum png2gba_error convert_input(struct Arguments *args,
+								 const struct InputFile *input,
+								 struct Image *image,
+								 char **output_names,
+								 struct HeldOutput *held,
+								 const char *name,
+								 char *output_buffer,
+								 struct Stats *stats) {
+	struct Converter converter;
+	enum png2gba_error error = png2gba_open(
+		&converter, &args->options, input->data, input->size, image, stats);
+	if (error) {
+		return error;
+	}
+
+	/* Output: Open */
+	FILE *files[PNG2GBA_OUTPUT_KINDS];
+	error = open_outputs(files, output_names, held);
+	if (error) {
+		png2gba_close(&converter);
+		return error;
+	}
+	char *header_name =
+		files[PNG2GBA_OUTPUT_SOURCE]
+			? extractFileName(output_names[PNG2GBA_OUTPUT_HEADER])
+			: NULL;
+	error = png2gba_write(&converter, name, files, header_name, output_buffer);
 
+	/* close up, we're done */
+	png2gba_close(&converter);
+	if (stats) {
+		int kind;
+		stats->bytes = 0;
+		for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+			if (files[kind]) {
+				stats->bytes += output_size(files[kind]);
+			}
+		}
+	}
+	error = close_outputs(files, output_names, held, error);
+	free(header_name);
+	return error;
+}
 
-	/* loop through the pixel data */
-	unsigned char red, green, blue;
-	int colors_this_line = 0;
-	png_byte *ptr;
+/* convert one input file, writing the -o file or <name>.h next to it,
+ * the image's work buffers are reused from the last conversion, what
+ * it took goes into stats unless that is NULL, if it fails everything
+ * it took is given back and any outputs it started are removed, so a
+ * batch can carry on to the next */
+enum png2gba_error convert_file(struct Arguments *args,
+								const char *input_file_name,
+								struct Image *image,
+								char *output_buffer,
+								struct Stats *stats) {
+	double begun = png2gba_stats_start(stats);
+
+	/* the image path without the extension, stdin is named by the symbol
+	 * name given */
+	char *name;
+	if (is_stdio(input_file_name)) {
+		name = strdup(args->symbol_name);
+	} else {
+		name = strdup(input_file_name);
+		char *extension = strstr(name, ".png");
+		if (!extension) {
+			free(name);
+			return PNG2GBA_ERROR_NAME;
+		}
+		*extension = '\0'; /* chop name down, less the extension */
+	}
 
-	while ((ptr = next_byte(image, tileize))) {
-		red = ptr[0];
-		green = ptr[1];
-		blue = ptr[2];
+	char *disp_name = args->symbol_name ? strdup(args->symbol_name)
+										: extractFileName(name);
+
+	/* Output: Determine Names, going to stdout the header holds it all
+	 * unless it is binary, then there is only the data */
+	int to_stdout = args->output_file_name && is_stdio(args->output_file_name);
+	char *output_names[PNG2GBA_OUTPUT_KINDS];
+	if (to_stdout) {
+		output_names[PNG2GBA_OUTPUT_HEADER] =
+			args->options.binary ? NULL : strdup("-");
+	} else if (args->output_file_name) {
+		output_names[PNG2GBA_OUTPUT_HEADER] = strdup(args->output_file_name);
+	} else {
+		output_names[PNG2GBA_OUTPUT_HEADER] =
+			malloc(sizeof(char) * (strlen(name) + 3));
+		sprintf(output_names[PNG2GBA_OUTPUT_HEADER], "%s.h", name);
+	}
+	int kind;
+	for (kind = PNG2GBA_OUTPUT_DATA; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		output_names[kind] = NULL;
+		if (args->options.binary && to_stdout) {
+			output_names[kind] =
+				kind == PNG2GBA_OUTPUT_DATA ? strdup("-") : NULL;
+		} else if (png2gba_output_wanted(&args->options, kind)) {
+			output_names[kind] = binary_output_name(
+				output_names[PNG2GBA_OUTPUT_HEADER], output_suffixes[kind]);
+		}
+	}
 
-		/* convert to 16-bit color */
-		unsigned short color = (blue >> 3) << 10;
-		color += (green >> 3) << 5;
-		color += (red >> 3);
+	/* outputs go into memory first if only changes are written */
+	struct HeldOutput held[PNG2GBA_OUTPUT_KINDS];
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		held[kind].hold = args->update;
+		held[kind].mode = args->file_mode;
+	}
 
-		/* print leading space if first of line */
-		if (colors_this_line == 0) {
-			fprintf(out, "    ");
+	/* Input: Map */
+	struct InputFile input;
+	enum png2gba_error error = map_input(input_file_name, &input);
+	int mapped = !error;
+
+	/* an unchanged input converted with the same options before can just
+	 * be copied out of the cache */
+	char key[CACHE_KEY_SIZE];
+	struct Cache *cache = to_stdout ? NULL : args->cache;
+	int cached = 0;
+	if (!error && cache) {
+		cache_key(&input,
+				  args,
+				  disp_name,
+				  output_names[PNG2GBA_OUTPUT_HEADER],
+				  key);
+		cached = cache_fetch(cache, key, output_names, held);
+		if (cached && stats) {
+			stats->cached = 1;
 		}
+	}
 
-		/* print color directly, or palette index */
-		if (!palette) {
-			fprintf(out, "0x%04X", color);
+	/* a palette being built up by the batch is put back as it was if the
+	 * image fails, so that none of its colors are left in it */
+	struct png2gba_palette *kept = NULL;
+	if (!error && !cached && args->options.shared_palette &&
+		!args->options.shared_palette->locked) {
+		kept = malloc(sizeof(struct png2gba_palette));
+		if (kept) {
+			memcpy(kept,
+				   args->options.shared_palette,
+				   sizeof(struct png2gba_palette));
 		} else {
-			unsigned char index =
-				insert_palette(color, color_palette, &palette_size);
-			fprintf(out, "0x%02X", index);
+			error = PNG2GBA_ERROR_MEMORY;
+		}
+	}
+
+	if (!error && !cached) {
+		error = convert_input(args,
+							  &input,
+							  image,
+							  output_names,
+							  held,
+							  disp_name,
+							  output_buffer,
+							  stats);
+		if (!error && cache) {
+			cache_store(cache, key, output_names);
+		}
+	}
+	if (kept) {
+		if (error) {
+			memcpy(args->options.shared_palette,
+				   kept,
+				   sizeof(struct png2gba_palette));
+		}
+		free(kept);
+	}
+	if (mapped) {
+		unmap_input(&input);
+	}
+
+	for (kind = 0; kind < PNG2GBA_OUTPUT_KINDS; kind++) {
+		free(output_names[kind]);
+	}
+	free(disp_name);
+	free(name);
+
+	if (stats) {
+		stats->total = png2gba_stats_clock() - begun;
+	}
+	return error;
+}
+
+/* takes the next job from our own queue, or steals one from the back
+ * of another worker's, returns -1 when there is nothing left anywhere */
+int next_job(struct Worker *worker) {
+	int i;
+	for (i = 0; i < worker->queue_count; i++) {
+		struct WorkQueue *queue =
+			&worker->queues[(worker->id + i) % worker->queue_count];
+		int job = -1;
+
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail) {
+			if (i == 0) {
+				job = queue->jobs[queue->head++];
+			} else {
+				job = queue->jobs[--queue->tail];
+			}
+		}
+		pthread_mutex_unlock(&queue->lock);
+
+		if (job >= 0) {
+			return job;
+		}
+	}
+	return -1;
+}
+
+/* thread entry point, converts jobs until the batch is done */
+void *work(void *data) {
+	struct Worker *worker = data;
+	int job;
+	while ((job = next_job(worker)) >= 0) {
+		const char *file_name = worker->args->input_file_names[job];
+		enum png2gba_error error = convert_file(
+			worker->args,
+			file_name,
+			&worker->image,
+			worker->output_buffer,
+			worker->args->stats ? &worker->args->stats[job] : NULL);
+		if (error) {
+			report_error(file_name, error);
+			worker->failures++;
 		}
+	}
+	return NULL;
+}
+
+/* spread the inputs across args->jobs threads, each thread starts with
+ * a contiguous run of inputs so stealing only happens near the end,
+ * returns how many inputs failed */
+int run_workers(struct Arguments *args) {
+	int count = args->jobs;
+
+	/* building one palette for the batch has to go in input order, so
+	 * the indices come out the same every time */
+	if (args->options.shared_palette && !args->options.shared_palette->locked) {
+		count = 1;
+	}
+	if (count > args->input_count) {
+		count = args->input_count;
+	}
+
+	struct WorkQueue *queues = alloc_setup(count, sizeof(struct WorkQueue));
+	struct Worker *workers = alloc_setup(count, sizeof(struct Worker));
+	int *jobs = alloc_setup(args->input_count, sizeof(int));
+	int i;
+	for (i = 0; i < args->input_count; i++) {
+		jobs[i] = i;
+	}
 
-		fprintf(out, ", ");
+	for (i = 0; i < count; i++) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].jobs = jobs;
+		queues[i].head = (long)args->input_count * i / count;
+		queues[i].tail = (long)args->input_count * (i + 1) / count;
+
+		workers[i].id = i;
+		workers[i].args = args;
+		workers[i].queues = queues;
+		workers[i].queue_count = count;
+		workers[i].output_buffer = alloc_setup(1, OUTPUT_BUFFER_SIZE);
+	}
 
-		/* increment colors on line unless too many */
-		colors_this_line++;
-		if ((colors_this_line >= TILE_SIZE)) {
-			fprintf(out, "\n");
-			colors_this_line = 0;
+	/* the main thread does its share as worker 0 */
+	for (i = 1; i < count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, work, &workers[i])) {
+			fprintf(stderr, "Error: Could not start worker thread!\n");
+			exit(-1);
 		}
 	}
+	work(&workers[0]);
+	for (i = 1; i < count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
 
-	/* write postamble stuff */
-	fprintf(out, "\n};\n\n");
+	int failures = 0;
+	for (i = 0; i < count; i++) {
+		failures += workers[i].failures;
+		pthread_mutex_destroy(&queues[i].lock);
+		free(workers[i].output_buffer);
+		png2gba_free_rows(&workers[i].image);
+	}
+	free(jobs);
+	free(workers);
+	free(queues);
+	return failures;
+}
 
-	/* write the palette if needed */
-	if (palette) {
-		int colors_this_line = 0;
-		fprintf(out, "const unsigned short %s_palette [] = {\n", name);
+/* writes the palette shared by a batch to its own file */
+enum png2gba_error write_shared_palette(struct Arguments *args,
+										char *output_buffer) {
+	char *header_name = malloc(strlen(args->shared_palette_name) + 3);
+	sprintf(header_name, "%s.h", args->shared_palette_name);
+	char *name = extractFileName(args->shared_palette_name);
+
+	struct HeldOutput held, source_held;
+	held.hold = source_held.hold = args->update;
+	held.mode = source_held.mode = args->file_mode;
+	char *output_name =
+		args->options.binary
+			? binary_output_name(header_name,
+								 output_suffixes[PNG2GBA_OUTPUT_PALETTE])
+			: strdup(header_name);
+	char *source_name =
+		args->options.source && !args->options.binary
+			? binary_output_name(header_name,
+								 output_suffixes[PNG2GBA_OUTPUT_SOURCE])
+			: NULL;
+
+	struct Outputs outputs;
+	outputs.binary = args->options.binary;
+	outputs.buffer = output_buffer;
+	outputs.stats = NULL;
+	outputs.compression = PNG2GBA_COMPRESS_NONE;
+	outputs.attributes = args->options.attributes;
+	outputs.header_name = extractFileName(header_name);
+	outputs.header =
+		open_output(output_name, args->options.binary ? "wb" : "w", &held);
+	outputs.source = source_name && outputs.header
+						 ? open_output(source_name, "w", &source_held)
+						 : NULL;
+	outputs.palette = outputs.source ? outputs.source : outputs.header;
+
+	enum png2gba_error error = PNG2GBA_ERROR_NONE;
+	if (!outputs.header || (source_name && !outputs.source)) {
+		if (outputs.header) {
+			close_output(outputs.header, output_name, &held, 1);
+		}
+		error = PNG2GBA_ERROR_OPEN_OUTPUT;
+	} else {
+		if (!args->options.binary) {
+			fprintf(outputs.header,
+					"/* %s.h\n * generated by png2gba */\n\n",
+					name);
+		}
+		if (outputs.source) {
+			fprintf(outputs.source,
+					"/* %s.c\n * generated by png2gba */\n\n"
+					"#include \"%s\"\n\n",
+					name,
+					outputs.header_name);
+		}
+
+		struct Emitter emitter;
+		png2gba_emit_begin(&emitter,
+						   &outputs,
+						   outputs.palette,
+						   2,
+						   name,
+						   "palette");
 		int i;
 		for (i = 0; i < PALETTE_MAX; i++) {
-			if (colors_this_line == 0) {
-				fprintf(out, "    ");
+			png2gba_emit_value(&emitter,
+							   args->options.shared_palette->colors[i]);
+		}
+		png2gba_emit_end(&emitter);
+
+		error = close_output(outputs.header, output_name, &held, 0);
+		if (outputs.source) {
+			enum png2gba_error closed =
+				close_output(outputs.source, source_name, &source_held, 0);
+			error = error ? error : closed;
+		}
+	}
+	free((char *)outputs.header_name);
+	free(source_name);
+	free(output_name);
+	free(name);
+	free(header_name);
+	return error;
+}
+
+/* writes text as a JSON string */
+void print_json_string(FILE *out, const char *text) {
+	fputc('"', out);
+	for (; *text; text++) {
+		unsigned char c = *text;
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/* writes one input's stats, or the batch totals, as a line of text or
+ * a JSON object */
+void print_stats(FILE *out,
+				 const char *name,
+				 const struct Stats *stats,
+				 int count,
+				 int json) {
+	int timer;
+	if (json) {
+		fprintf(out, "{\"name\": ");
+		print_json_string(out, name);
+		for (timer = 0; timer < TIMERS; timer++) {
+			fprintf(out,
+					", \"%s_ms\": %.3f",
+					png2gba_timer_names[timer],
+					stats->seconds[timer] * 1000);
+		}
+		fprintf(out,
+				", \"total_ms\": %.3f, \"pixels\": %ld, \"colors\": %d, "
+				"\"bytes\": %ld, \"cached\": %d}",
+				stats->total * 1000,
+				stats->pixels,
+				stats->colors,
+				stats->bytes,
+				stats->cached);
+		return;
+	}
+
+	fprintf(out, "%s:", name);
+	for (timer = 0; timer < TIMERS; timer++) {
+		fprintf(out,
+				" %s %.3f ms,",
+				png2gba_timer_names[timer],
+				stats->seconds[timer] * 1000);
+	}
+	fprintf(out,
+			" total %.3f ms, %ld pixels, %d colors, %ld bytes",
+			stats->total * 1000,
+			stats->pixels,
+			stats->colors,
+			stats->bytes);
+	if (count > 1 || stats->cached) {
+		fprintf(out, ", %d cached", stats->cached);
+	}
+	fputc('\n', out);
+}
+
+/* writes the stats of every input and their totals to stderr, the
+ * colors total is the most any one image used */
+void report_stats(struct Arguments *args, double seconds) {
+	struct Stats total;
+	memset(&total, 0, sizeof(total));
+
+	int i, timer;
+	for (i = 0; i < args->input_count; i++) {
+		struct Stats *stats = &args->stats[i];
+		for (timer = 0; timer < TIMERS; timer++) {
+			total.seconds[timer] += stats->seconds[timer];
+		}
+		total.pixels += stats->pixels;
+		if (stats->colors > total.colors) {
+			total.colors = stats->colors;
+		}
+		total.bytes += stats->bytes;
+		total.cached += stats->cached;
+	}
+
+	/* the batch total is wall time, which threads make less than the sum */
+	total.total = seconds;
+
+	if (args->stats_json) {
+		fprintf(stderr, "{\"files\": [");
+		for (i = 0; i < args->input_count; i++) {
+			fprintf(stderr, i ? ",\n  " : "\n  ");
+			print_stats(stderr,
+						args->input_file_names[i],
+						&args->stats[i],
+						1,
+						1);
+		}
+		fprintf(stderr, "],\n \"total\": ");
+		print_stats(stderr, "total", &total, args->input_count, 1);
+		fprintf(stderr, "}\n");
+	} else {
+		for (i = 0; i < args->input_count; i++) {
+			print_stats(stderr,
+						args->input_file_names[i],
+						&args->stats[i],
+						1,
+						0);
+		}
+		print_stats(stderr, "total", &total, args->input_count, 0);
+	}
+}
+
+/* converts a png in the watched directory which has changed, straight
+ * away on the buffers left from the last one, and the shared palette
+ * along with it since the image may have added to it */
+void convert_changed(struct Arguments *args,
+					 const char *file_name,
+					 struct Image *image,
+					 char *output_buffer) {
+	char *path = directory_path(args->watch_directory, file_name);
+	struct Stats stats;
+	memset(&stats, 0, sizeof(stats));
+	enum png2gba_error error = convert_file(
+		args, path, image, output_buffer, args->stats ? &stats : NULL);
+	if (error) {
+		report_error(path, error);
+	} else if (args->shared_palette_name) {
+		error = write_shared_palette(args, output_buffer);
+		if (error) {
+			report_error(args->shared_palette_name, error);
+		}
+	}
+	if (args->stats && !error) {
+		print_stats(stderr, path, &stats, 1, args->stats_json);
+		if (args->stats_json) {
+			fputc('\n', stderr);
+		}
+	}
+	free(path);
+}
+
+/* how often the watched directory is looked over when it can't be
+ * told to us as files change */
+#define WATCH_POLL_MS 250
+
+/* the last seen state of a png in a watched directory being polled */
+struct WatchedFile {
+	char *name;
+	time_t mtime;
+	off_t size;
+
+	/* a change is only converted once the file has stopped changing for
+	 * a whole poll, so that it isn't read half written */
+	int changing;
+};
+
+/* watches the directory by looking over it every WATCH_POLL_MS, for
+ * systems without a way to be told of changes */
+void poll_directory(struct Arguments *args,
+					struct Image *image,
+					char *output_buffer) {
+	struct WatchedFile *files = NULL;
+	int count = 0, capacity = 0, scans;
+	struct timespec interval = {0, WATCH_POLL_MS * 1000000L};
+
+	for (scans = 0;; scans++) {
+		DIR *directory = opendir(args->watch_directory);
+		if (!directory) {
+			fprintf(stderr,
+					"Error: Can not read directory %s!\n",
+					args->watch_directory);
+			exit(-1);
+		}
+
+		struct dirent *entry;
+		while ((entry = readdir(directory))) {
+			if (!is_png(entry->d_name)) {
+				continue;
 			}
-			fprintf(out, "0x%04x", color_palette[i]);
-			if (i != (PALETTE_MAX - 1)) {
-				fprintf(out, ", ");
+			char *path = directory_path(args->watch_directory, entry->d_name);
+			struct stat info;
+			int found = !stat(path, &info);
+			free(path);
+			if (!found) {
+				continue;
+			}
+
+			int i;
+			for (i = 0; i < count; i++) {
+				if (!strcmp(files[i].name, entry->d_name)) {
+					break;
+				}
 			}
-			colors_this_line++;
-			if (colors_this_line > 8) {
-				fprintf(out, "\n");
-				colors_this_line = 0;
+
+			/* the first scan sees what the batch has just converted */
+			if (i == count) {
+				if (count == capacity) {
+					capacity = capacity ? capacity * 2 : 64;
+					files =
+						realloc(files, sizeof(struct WatchedFile) * capacity);
+				}
+				files[count].name = strdup(entry->d_name);
+				files[count].changing = scans > 0;
+				count++;
+			} else if (files[i].mtime != info.st_mtime ||
+					   files[i].size != info.st_size) {
+				files[i].changing = 1;
+			} else if (files[i].changing) {
+				files[i].changing = 0;
+				convert_changed(args, files[i].name, image, output_buffer);
 			}
+			files[i].mtime = info.st_mtime;
+			files[i].size = info.st_size;
 		}
-		fprintf(out, "\n};\n\n");
+		closedir(directory);
+
+		nanosleep(&interval, NULL);
 	}
+}
 
-	/* close up, we're done */
-	fclose(out);
+/* converts each png in the watched directory again whenever it is
+ * written, until killed, one at a time and reusing the same buffers,
+ * with inotify where there is one and polling otherwise */
+void watch_inputs(struct Arguments *args) {
+	struct Image image;
+	memset(&image, 0, sizeof(image));
+	char *output_buffer = alloc_setup(1, OUTPUT_BUFFER_SIZE);
+
+#if defined(__linux__)
+	/* editors either write the file in place or write another and move
+	 * it over, so watch for both */
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd,
+									 args->watch_directory,
+									 IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) {
+		char events[4096]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t length;
+		while ((length = read(fd, events, sizeof(events))) > 0) {
+			/* one save can close the file more than once, so give the
+			 * same file in a row just one conversion */
+			const char *last = NULL;
+			char *offset = events;
+			while (offset < events + length) {
+				struct inotify_event *event = (struct inotify_event *)offset;
+				offset += sizeof(struct inotify_event) + event->len;
+				if (!event->len || !is_png(event->name) ||
+					(last && !strcmp(last, event->name))) {
+					continue;
+				}
+				convert_changed(args, event->name, &image, output_buffer);
+				last = event->name;
+			}
+		}
+		fprintf(stderr, "Error: Could not watch %s!\n", args->watch_directory);
+		exit(-1);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+#endif
+	poll_directory(args, &image, output_buffer);
 }
 
 int main(int argc, char **argv) {
@@ -322,29 +1338,163 @@ int main(int argc, char **argv) {
 
 	/* the default values */
 	args.output_file_name = NULL;
-	args.input_file_name = NULL;
-	args.colorkey = "#ff00ff";
-	args.palette = 0;
-	args.tileize = 0;
+	args.symbol_name = NULL;
+	args.input_file_names = NULL;
+	args.input_count = 0;
+	png2gba_defaults(&args.options);
+	args.jobs = 1;
+	args.cache = NULL;
+	args.palette_file_name = NULL;
+	args.shared_palette_name = NULL;
+	args.palette_hash = 0;
+	args.stats = NULL;
+	args.stats_json = 0;
+	args.watch_directory = NULL;
+	args.update = 0;
+	int align = 0;
+	char *section = NULL;
+	int stats = 0;
+
+	/* the options which only have a long form */
+	static const struct option long_options[] = {
+		{"stats", optional_argument, NULL, 'S'},
+		{"dither", no_argument, NULL, 'D'},
+		{"section", required_argument, NULL, 'E'},
+		{NULL, 0, NULL, 0}};
 
 	/* parse command line */
 	int opt, p;
-	while ((opt = getopt(argc, argv, "p::to:i:c:h")) != -1) {
+	while ((opt = getopt_long(argc,
+							  argv,
+							  "p::tdM:B:f:bz:qa:xo:n:i:m:w:uc:j:C:s:P:h",
+							  long_options,
+							  NULL)) != -1) {
 		/* switch on the command line option that was passed in */
 		switch (opt) {
 			case 'p':
 				/* set the palette option */
-				p = atoi(optarg);
+				p = optarg ? atoi(optarg) : 0;
 				if (p) {
-					args.palette = p;
+					args.options.palette = p;
 				} else {
-					args.palette = PALETTE_MAX;
+					args.options.palette = PALETTE_MAX;
 				}
 				break;
 
 			case 't':
 				/* set the tileize option */
-				args.tileize = 1;
+				args.options.tileize = 1;
+				break;
+
+			case 'd':
+				/* write each distinct tile once, along with a map */
+				args.options.dedup = 1;
+				args.options.tileize = 1;
+				break;
+
+			case 'M':
+				/* lay the map out in screenblocks or for an affine
+				 * background, which means making one */
+				for (p = 0; p < PNG2GBA_MAP_LAYOUTS; p++) {
+					if (!strcmp(optarg, png2gba_map_layout_names[p])) {
+						break;
+					}
+				}
+				if (p == PNG2GBA_MAP_LAYOUTS) {
+					fprintf(stderr,
+							"Map layout must be rows, screen or affine");
+					exit(-1);
+				}
+				args.options.map_layout = p;
+				args.options.dedup = 1;
+				args.options.tileize = 1;
+				break;
+
+			case 'B':
+				/* spread the colors of 4bpp tiles over palette banks,
+				 * which the map picks between */
+				args.options.bank_count = atoi(optarg);
+				if (args.options.bank_count < 1 ||
+					args.options.bank_count > BANK_MAX) {
+					fprintf(stderr, "Palette banks must be from 1 to 16");
+					exit(-1);
+				}
+				args.options.dedup = 1;
+				args.options.tileize = 1;
+				break;
+
+			case 'f':
+				/* slice a sprite sheet into frames of this size */
+				if (sscanf(optarg,
+						   "%dx%d",
+						   &args.options.frame_width,
+						   &args.options.frame_height) != 2 ||
+					!png2gba_valid_frame(args.options.frame_width,
+										 args.options.frame_height)) {
+					fprintf(stderr,
+							"Frames must be a sprite size, from 8x8 to 64x64");
+					exit(-1);
+				}
+				args.options.tileize = 1;
+				break;
+
+			case 'b':
+				/* write the arrays as raw binary files */
+				args.options.binary = 1;
+				break;
+
+			case 'z':
+				/* compress the data for the BIOS to unpack */
+				for (p = 0; p < PNG2GBA_COMPRESSIONS; p++) {
+					if (!strcmp(optarg, png2gba_compression_names[p])) {
+						break;
+					}
+				}
+				if (!strcmp(optarg, "huff")) {
+					p = PNG2GBA_COMPRESS_HUFF8;
+				}
+				if (p == PNG2GBA_COMPRESSIONS) {
+					fprintf(stderr,
+							"Compression must be lz77, rle, huff4 or huff8");
+					exit(-1);
+				}
+				args.options.compression = p;
+				break;
+
+			case 'q':
+				/* cut images with too many colors down to the palette */
+				if (!args.options.quantize) {
+					args.options.quantize = 1;
+				}
+				break;
+
+			case 'D':
+				/* quantize with an ordered dither */
+				args.options.quantize = 2;
+				break;
+
+			case 'a':
+				/* align each array to this many bytes */
+				align = atoi(optarg);
+				if (align < 1 || (align & (align - 1))) {
+					fprintf(stderr, "Alignment must be a power of two");
+					exit(-1);
+				}
+				break;
+
+			case 'E':
+				/* put each array in this section */
+				section = optarg;
+				if (strpbrk(section, "\"\\")) {
+					fprintf(stderr, "Section names can't have quotes");
+					exit(-1);
+				}
+				break;
+
+			case 'x':
+				/* define the arrays in a .c file, leaving the header with
+				 * declarations of them */
+				args.options.source = 1;
 				break;
 
 			case 'o':
@@ -352,17 +1502,92 @@ int main(int argc, char **argv) {
 				args.output_file_name = optarg;
 				break;
 
+			case 'n':
+				/* the name of the arrays, rather than the file's */
+				args.symbol_name = optarg;
+				break;
+
 			case 'c':
 				/* the colorkey is set */
-				args.colorkey = optarg;
+				args.options.colorkey = optarg;
 				break;
 
 			case 'i':
-				args.input_file_name = optarg;
+				/* may be given many times to convert a batch */
+				add_input(&args, optarg);
+				break;
+
+			case 'm':
+				/* a manifest file listing inputs, one per line */
+				read_manifest(&args, optarg);
+				break;
+
+			case 'w':
+				/* convert the pngs in a directory, then keep converting
+				 * them as they change */
+				args.watch_directory = optarg;
+				add_directory(&args, optarg);
+				break;
+
+			case 'u':
+				/* leave outputs which would come out the same alone */
+				args.update = 1;
+				break;
+
+			case 'j':
+				/* the number of threads to convert with */
+				args.jobs = atoi(optarg);
+				if (args.jobs < 1) {
+					fprintf(stderr, "Jobs must be at least 1");
+					exit(-1);
+				}
+				break;
+
+			case 'C':
+				/* keep converted outputs in this directory for reuse */
+				args.cache = alloc_setup(1, sizeof(struct Cache));
+				args.cache->directory = optarg;
+				if (!make_directories(optarg)) {
+					fprintf(stderr,
+							"Error: Can not create cache directory %s!\n",
+							optarg);
+					exit(-1);
+				}
+				pthread_mutex_init(&args.cache->lock, NULL);
+				break;
+
+			case 's':
+				/* build one palette for every image, written to this file */
+				args.shared_palette_name = optarg;
+				break;
+
+			case 'P':
+				/* map every image into the palette in this file */
+				args.palette_file_name = optarg;
+				break;
+
+			case 'S':
+				/* time each stage, reported as text or as JSON */
+				stats = 1;
+				if (optarg && !strcmp(optarg, "json")) {
+					args.stats_json = 1;
+				} else if (optarg) {
+					fprintf(stderr, "Stats can only be written as json");
+					exit(-1);
+				}
 				break;
 
 			case 'h':
-				fprintf(stdout, "");
+				fprintf(stdout,
+						"Usage: %s [-p[16|256]] [-t] [-d] "
+						"[-M rows|screen|affine] [-B banks] [-f WxH] [-b] "
+						"[-z lz77|rle|huff4|huff8] [-q] [--dither] [-a align] "
+						"[--section name] [-x] "
+						"[-c #rrggbb] [-o output.h|-] [-n name] -i input.png|- "
+						"[-i input.png ...] [-m manifest] [-w directory] [-u] "
+						"[-j jobs] [-C cache] [-s palette] [-P palette.pal] "
+						"[--stats[=json]]\n",
+						argv[0]);
 				exit(0);
 
 			case '?':
@@ -372,70 +1597,162 @@ int main(int argc, char **argv) {
 	}
 
 	/* Verify Arguments */
-	if (args.input_file_name == NULL) {
+	if (args.input_count == 0 && !args.watch_directory) {
 		fprintf(stderr, "No Input Specified");
 		exit(-1);
 	}
-	if (args.palette) {
-		if ((args.palette != 16) && (args.palette != 256)) {
-			fprintf(stderr, "Palette must be 16 or 256 colors");
+	if (args.output_file_name && args.input_count > 1) {
+		fprintf(stderr, "Output file can only be given for a single input");
+		exit(-1);
+	}
+	if (args.watch_directory &&
+		(args.output_file_name || args.symbol_name)) {
+		fprintf(stderr,
+				"A watched directory's files can't be given an output or name");
+		exit(-1);
+	}
+	if (args.symbol_name && args.input_count > 1) {
+		fprintf(stderr, "A name can only be given for a single input");
+		exit(-1);
+	}
+	int i;
+	for (i = 0; i < args.input_count; i++) {
+		if (is_stdio(args.input_file_names[i]) && !args.symbol_name) {
+			fprintf(stderr, "Reading from stdin needs a name (-n)");
 			exit(-1);
 		}
 	}
-
-	/* the image path without the extension */
-	char *name = strdup(args.input_file_name);
-	char *extension = strstr(name, ".png");
-	if (!extension) {
-		fprintf(stderr, "Error: File name should end in .png!\n");
+	if (args.output_file_name && is_stdio(args.output_file_name) &&
+		args.options.binary &&
+		((args.options.palette && !args.shared_palette_name) ||
+		 args.options.dedup || args.options.frame_width)) {
+		fprintf(stderr,
+				"Only the data can be written to stdout in binary, so not "
+				"a palette (without -s), map or frames");
+		exit(-1);
+	}
+	if (args.options.source && args.output_file_name &&
+		is_stdio(args.output_file_name)) {
+		fprintf(stderr, "A source file can not be written to stdout");
 		exit(-1);
 	}
-	*extension = '\0'; /* chop name down, less the extension */
-
-	char *disp_name = extractFileName(name);
 
-	/* Input: Open, Read, Close */
-	FILE *input = fopen(args.input_file_name, "rb");
-	if (!input) {
+	/* the library checks the options make sense together, apart from the
+	 * shared palette, which isn't set up yet */
+	enum png2gba_error error = png2gba_check_options(&args.options);
+	if (error) {
+		fprintf(stderr, "%s", png2gba_error_messages[error]);
+		exit(-1);
+	}
+	if (args.options.bank_count &&
+		(args.shared_palette_name || args.palette_file_name)) {
 		fprintf(stderr,
-				"Error: Can not open %s for reading!\n",
-				args.input_file_name);
-		return -1;
+				"%s",
+				png2gba_error_messages[PNG2GBA_ERROR_OPTION_BANK_SHARED]);
+		exit(-1);
+	}
+	if ((args.shared_palette_name || args.palette_file_name) &&
+		!args.options.palette) {
+		fprintf(stderr,
+				"%s",
+				png2gba_error_messages[PNG2GBA_ERROR_OPTION_SHARED_PALETTE]);
+		exit(-1);
+	}
+	if (args.options.quantize && args.shared_palette_name) {
+		fprintf(stderr,
+				"%s",
+				png2gba_error_messages[PNG2GBA_ERROR_OPTION_QUANTIZE_SHARED]);
+		exit(-1);
 	}
-	struct Image *image = read_png(input);
-	fclose(input);
 
-	/* Output: Determine Name, Open */
-	FILE *output;
-	char *output_name;
-	if (args.output_file_name) {
-		output_name = args.output_file_name;
-	} else {
-		output_name = malloc(sizeof(char) * (strlen(name) + 3));
-		sprintf(output_name, "%s.h", name);
+	/* set up the palette every image is going to share */
+	if (args.palette_file_name) {
+		args.options.shared_palette =
+			alloc_setup(1, sizeof(struct png2gba_palette));
+		load_palette(args.palette_file_name,
+					 args.options.palette,
+					 args.options.shared_palette);
+		args.palette_hash = palette_hash(args.options.shared_palette);
+	} else if (args.shared_palette_name) {
+		args.options.shared_palette =
+			alloc_setup(1, sizeof(struct png2gba_palette));
+		args.options.shared_palette->max = args.options.palette;
+		png2gba_insert_palette(png2gba_hex24_to_15(args.options.colorkey),
+							   args.options.shared_palette);
+
+		/* the palette is only complete once every image is converted */
+		if (args.cache) {
+			fprintf(stderr, "Warning: Not caching with a shared palette\n");
+			args.cache = NULL;
+		}
 	}
-	output = fopen(output_name, "w");
 
-	/* write preamble stuff */
-	fprintf(output, "/* %s.h\n * generated by png2gba */\n\n", name);
-	fprintf(output, "#define %s_width %d\n", name, image->width);
-	fprintf(output, "#define %s_height %d\n\n", name, image->height);
-	if (args.palette) {
-		fprintf(output, "const unsigned char %s_data [] = {\n", name);
-	} else {
-		fprintf(output, "const unsigned short %s_data [] = {\n", name);
+	/* a shared palette has a file of its own, the images leave it out */
+	args.options.omit_palette = args.shared_palette_name != NULL;
+
+	/* the attributes the arrays are defined with */
+	if (align || section) {
+		char *attributes = alloc_setup(1, strlen(section ? section : "") + 64);
+		char *end = attributes;
+		end += sprintf(end, " __attribute__((");
+		if (align) {
+			end += sprintf(end, "aligned(%d)%s", align, section ? ", " : "");
+		}
+		if (section) {
+			end += sprintf(end, "section(\"%s\")", section);
+		}
+		sprintf(end, "))");
+		args.options.attributes = attributes;
+	}
+
+	/* new outputs get the mode fopen would give them, worked out before
+	 * any threads start as umask can only be read by setting it */
+	args.file_mode = umask(0);
+	umask(args.file_mode);
+	args.file_mode = 0666 & ~args.file_mode;
+
+	/* the inputs are all known now, so each can have its own stats */
+	if (stats) {
+		args.stats = alloc_setup(args.input_count, sizeof(struct Stats));
 	}
 
-	/* Create Palette and insert Transparent Color */
-	struct Palette palette;
-	memset(&palette, 0, sizeof(palette));
-	palette.max = args.palette;
-	insert_palette(hex24_to_15(args.colorkey), &palette);
+	/* convert every input, one output buffer per worker */
+	double start = png2gba_stats_start(args.stats);
+	int failures = args.input_count ? run_workers(&args) : 0;
+	int palette_failed = 0;
+
+	if (args.shared_palette_name) {
+		char *output_buffer = alloc_setup(1, OUTPUT_BUFFER_SIZE);
+		enum png2gba_error error = write_shared_palette(&args, output_buffer);
+		if (error) {
+			report_error(args.shared_palette_name, error);
+			palette_failed = 1;
+		}
+		free(output_buffer);
+	}
 
+	if (args.cache) {
+		fprintf(stderr,
+				"Cache: %d hits, %d misses\n",
+				args.cache->hits,
+				args.cache->misses);
+	}
 
+	if (args.stats) {
+		report_stats(&args, png2gba_stats_clock() - start);
+	}
 
+	if (failures) {
+		fprintf(stderr,
+				"Error: %d of %d inputs could not be converted!\n",
+				failures,
+				args.input_count);
+	}
 
-	png2gba(input, output, name, args.palette, args.tileize, args.colorkey);
+	if (args.watch_directory) {
+		watch_inputs(&args);
+	}
+	free(args.stats);
 
-	return 0;
+	return failures || palette_failed ? -1 : 0;
 }
@@ -0,0 +1,144 @@
+/* The png2gba library, which converts PNG images held in memory into
+ * the arrays GBA programs need, for any program which wants to convert
+ * images itself, build with make libpng2gba.a and link with -lpng -lz
+ * -lpthread */
+
+#ifndef PNG2GBA_H
+#define PNG2GBA_H
+
+#include <stddef.h>
+
+/* the ways converting an image can fail, the steps of a conversion
+ * return one of these rather than exiting, so that a batch or a watched
+ * directory can go on past a bad input once it has been reported */
+enum png2gba_error {
+	PNG2GBA_ERROR_NONE,
+	PNG2GBA_ERROR_OPEN_INPUT,
+	PNG2GBA_ERROR_NAME,
+	PNG2GBA_ERROR_NOT_PNG,
+	PNG2GBA_ERROR_READ_PNG,
+	PNG2GBA_ERROR_MEMORY,
+	PNG2GBA_ERROR_COLORS,
+	PNG2GBA_ERROR_BANK_COLORS,
+	PNG2GBA_ERROR_TILE_COLORS,
+	PNG2GBA_ERROR_BANKS,
+	PNG2GBA_ERROR_TILES,
+	PNG2GBA_ERROR_TILEIZE_SIZE,
+	PNG2GBA_ERROR_SCREENBLOCK_SIZE,
+	PNG2GBA_ERROR_AFFINE_SIZE,
+	PNG2GBA_ERROR_FRAME_SIZE,
+	PNG2GBA_ERROR_COMPRESS_SIZE,
+	PNG2GBA_ERROR_OPEN_OUTPUT,
+	PNG2GBA_ERROR_WRITE_OUTPUT,
+	PNG2GBA_ERROR_OPTION_PALETTE,
+	PNG2GBA_ERROR_OPTION_COLORKEY,
+	PNG2GBA_ERROR_OPTION_DEDUP_TILEIZE,
+	PNG2GBA_ERROR_OPTION_DEDUP_PALETTE,
+	PNG2GBA_ERROR_OPTION_DEDUP_FRAMES,
+	PNG2GBA_ERROR_OPTION_FRAME_COMPRESSION,
+	PNG2GBA_ERROR_OPTION_MAP_LAYOUT,
+	PNG2GBA_ERROR_OPTION_MAP_DEDUP,
+	PNG2GBA_ERROR_OPTION_AFFINE_PALETTE,
+	PNG2GBA_ERROR_OPTION_BANK_COUNT,
+	PNG2GBA_ERROR_OPTION_BANK_DEDUP,
+	PNG2GBA_ERROR_OPTION_BANK_PALETTE,
+	PNG2GBA_ERROR_OPTION_BANK_SHARED,
+	PNG2GBA_ERROR_OPTION_FRAME_SIZE,
+	PNG2GBA_ERROR_OPTION_FRAME_TILEIZE,
+	PNG2GBA_ERROR_OPTION_SHARED_PALETTE,
+	PNG2GBA_ERROR_OPTION_QUANTIZE,
+	PNG2GBA_ERROR_OPTION_QUANTIZE_PALETTE,
+	PNG2GBA_ERROR_OPTION_QUANTIZE_SHARED,
+	PNG2GBA_ERROR_OPTION_COMPRESSION,
+	PNG2GBA_ERROR_OPTION_SOURCE,
+	PNG2GBA_ERRORS
+};
+
+/* a message saying what went wrong for each error */
+extern const char *png2gba_error_messages[PNG2GBA_ERRORS];
+
+/* the formats the GBA BIOS can decompress, for the data array */
+enum png2gba_compression {
+	PNG2GBA_COMPRESS_NONE,
+	PNG2GBA_COMPRESS_LZ77,
+	PNG2GBA_COMPRESS_RLE,
+	PNG2GBA_COMPRESS_HUFF4,
+	PNG2GBA_COMPRESS_HUFF8,
+	PNG2GBA_COMPRESSIONS
+};
+extern const char *png2gba_compression_names[PNG2GBA_COMPRESSIONS];
+
+/* how the map is laid out: row by row, split into screenblocks, or as
+ * the one byte entries of an affine background */
+enum png2gba_map_layout {
+	PNG2GBA_MAP_ROWS,
+	PNG2GBA_MAP_SCREENBLOCKS,
+	PNG2GBA_MAP_AFFINE,
+	PNG2GBA_MAP_LAYOUTS
+};
+extern const char *png2gba_map_layout_names[PNG2GBA_MAP_LAYOUTS];
+
+/* the kinds of file a conversion can write */
+enum png2gba_output {
+	PNG2GBA_OUTPUT_HEADER,
+	PNG2GBA_OUTPUT_DATA,
+	PNG2GBA_OUTPUT_PALETTE,
+	PNG2GBA_OUTPUT_MAP,
+	PNG2GBA_OUTPUT_FRAMES,
+	PNG2GBA_OUTPUT_SOURCE,
+	PNG2GBA_OUTPUT_KINDS
+};
+
+/* a palette shared between conversions */
+struct png2gba_palette;
+
+/* what a conversion makes, everything on the command line which
+ * changes what an image is converted to, set up with png2gba_defaults
+ * and checked by png2gba_check_options, palette is 0 for 16-bit color
+ * or 16 or 256, map_layout is a png2gba_map_layout, compression a
+ * png2gba_compression and quantize 1 to quantize and 2 to dither */
+struct png2gba_options {
+	int palette;
+	int tileize;
+	int dedup;
+	int map_layout;
+	int bank_count;
+	int frame_width, frame_height;
+	int binary;
+	int compression;
+	int quantize;
+	const char *colorkey;
+
+	/* a palette used by every image, which only the png2gba command
+	 * makes, or NULL, and whether it is written on its own and so left
+	 * out of each image's outputs */
+	struct png2gba_palette *shared_palette;
+	int omit_palette;
+
+	/* define the arrays in a .c file of their own rather than the header,
+	 * and what to put on each one's definition, or NULL */
+	int source;
+	const char *attributes;
+};
+
+/* the outputs made in memory by png2gba_convert, for each kind of
+ * output, NULL and 0 for those which weren't wanted */
+struct png2gba_buffers {
+	char *data[PNG2GBA_OUTPUT_KINDS];
+	size_t size[PNG2GBA_OUTPUT_KINDS];
+};
+
+/* sets options to the defaults, checks options make sense, says which
+ * outputs a conversion with them makes, and converts a png with them */
+void png2gba_defaults(struct png2gba_options *options);
+enum png2gba_error png2gba_check_options(const struct png2gba_options *options);
+int png2gba_output_wanted(const struct png2gba_options *options,
+						  enum png2gba_output kind);
+enum png2gba_error png2gba_convert(const struct png2gba_options *options,
+								   const unsigned char *data,
+								   size_t size,
+								   const char *name,
+								   struct png2gba_buffers *buffers);
+void png2gba_free_buffers(struct png2gba_buffers *buffers);
+
+#endif
@@ -0,0 +1,272 @@
+/* The insides of the png2gba library shared with the png2gba command
+ * and the benchmark, which programs using the library shouldn't need */
+
+#ifndef PNG2GBA_INTERNAL_H
+#define PNG2GBA_INTERNAL_H
+
+#include <stdio.h>
+
+#define PNG_DEBUG 3
+#include <png.h>
+#include <zlib.h>
+
+#include "png2gba.h"
+
+/* the GBA palette has a limit of 256 colors */
+#define PALETTE_MAX 256
+
+/* GBA colors are 15 bits, so every color can be looked up directly */
+#define COLOR_COUNT (1 << 15)
+
+/* the GBA always uses 8x8 tiles */
+#define TILE_SIZE 8
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+/* screen entries have 10 bits for the tile, then the flip bits */
+#define MAP_TILE_MAX 1024
+#define SE_HFLIP 0x0400
+#define SE_VFLIP 0x0800
+
+/* a 4bpp screen entry picks one of 16 palette banks of 16 colors in the
+ * top bits, each bank's first color being transparent */
+#define BANK_MAX 16
+#define BANK_SIZE 16
+#define SE_BANK_SHIFT 12
+
+/* a regular map is held in screenblocks of 32x32 entries */
+#define SCREENBLOCK_SIZE 32
+
+/* affine map entries are one byte, with no flip bits, for maps from
+ * 16x16 to 128x128 tiles */
+#define AFFINE_TILE_MAX 256
+#define AFFINE_MAP_MIN 16
+#define AFFINE_MAP_MAX 128
+
+/* size of the buffer output is formatted into before being written */
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/* image data, as it was in the file */
+struct Image {
+	int width, height;
+	png_byte color_type;
+	png_byte bit_depth;
+
+	/* each row as decoded, already in 15-bit GBA colors, or palette
+	 * indices when indexed */
+	png_bytep *rows;
+	int row_capacity;
+	int indexed;
+
+	/* work buffers with one entry per pixel, kept between images so that
+	 * they can be reused whenever the next one fits: the decoded colors
+	 * which the rows point into, their palette indices, and either of
+	 * those put into output order */
+	unsigned short *colors;
+	unsigned char *indices;
+	void *ordered;
+	png_bytep work;
+	size_t work_capacity;
+};
+
+struct png2gba_palette {
+	unsigned short colors[PALETTE_MAX];
+	unsigned short used;
+	unsigned short max;
+
+	/* a fixed palette is never added to, colors not in it are mapped to
+	 * the nearest one which is */
+	int locked;
+
+	/* index + 1 of each color in the palette, 0 if it isn't there */
+	unsigned short lookup[COLOR_COUNT];
+};
+
+/* the stages of a conversion which are timed for --stats */
+enum Timer { TIMER_DECODE, TIMER_CONVERT, TIMER_PALETTE, TIMER_WRITE, TIMERS };
+extern const char *png2gba_timer_names[TIMERS];
+
+/* what one conversion spent its time on and what it made, each input
+ * has its own so workers never share one */
+struct Stats {
+	double seconds[TIMERS];
+	double total;
+	long pixels;
+	int colors;
+	long bytes;
+	int cached;
+};
+
+/* a png file opened by open_png, ready to have its rows read */
+struct PngReader {
+	png_structp png;
+	png_infop info;
+	int interlaced;
+
+	/* the png file in memory, and how far libpng has read */
+	const unsigned char *data;
+	size_t size, offset;
+
+	/* where the time spent converting rows goes, or NULL */
+	struct Stats *stats;
+
+	/* why libpng gave up on the png, it is never printed so the error
+	 * returned is all the caller hears of it */
+	char message[64];
+
+	/* what each index of a paletted png becomes in the GBA palette, and
+	 * whether any of them move */
+	unsigned char remap[PALETTE_MAX];
+	int remapped;
+
+	/* set when the png is simple enough for decode_png to read it in
+	 * place of libpng: 8-bit RGB, RGBA or paletted, and not interlaced */
+	int fast;
+	int channels;
+	size_t stride;
+	int indices;
+
+	/* the filter byte and pixels of the row being read and the row above
+	 * it, which starts out as zeros, both in lines */
+	png_bytep lines, line, previous;
+
+	/* each PLTE entry as a 15-bit color, for paletted pngs which are not
+	 * read as indices */
+	unsigned short colors[PALETTE_MAX];
+
+	/* the image data is inflated a row at a time straight out of the
+	 * IDAT chunks in the file, or all at once with libdeflate, and
+	 * idat_left is what is left of the chunk zlib is part way through */
+	z_stream zlib;
+	size_t idat_left;
+	png_bytep inflated;
+};
+
+/* a growing run of bytes for a compressor to write into */
+struct Bytes {
+	unsigned char *data;
+	size_t used, capacity;
+};
+
+/* the files written by a conversion, in C header mode the data,
+ * palette and map go to the header too */
+struct Outputs {
+	int binary;
+	FILE *header;
+	FILE *data;
+	FILE *palette;
+	FILE *map;
+	FILE *frames;
+
+	/* where the emitters format the arrays */
+	char *buffer;
+
+	/* where the time spent writing goes, or NULL */
+	struct Stats *stats;
+
+	/* how the data array is compressed */
+	enum png2gba_compression compression;
+
+	/* when the arrays are defined in a source file of their own, the
+	 * header only declares them and is included by name from it */
+	FILE *source;
+	const char *header_name;
+
+	/* written after each array's name when defining it, or NULL */
+	const char *attributes;
+};
+
+/* writes one array, either as C source text or as raw little-endian
+ * bytes suitable for incbin, formatting into an in-memory buffer which
+ * goes out in one fwrite whenever it fills up */
+struct Emitter {
+	FILE *out;
+	int binary;
+
+	/* bytes per element */
+	int size;
+
+	/* elements written on the current line of text */
+	int column;
+
+	/* the pending output */
+	char *buffer;
+	size_t used;
+
+	/* where the time spent writing goes, or NULL */
+	struct Stats *stats;
+
+	/* a compressed array is held back to be compressed at the end, and
+	 * failed is set if there was no memory to hold it */
+	enum png2gba_compression compression;
+	struct Bytes raw;
+	int failed;
+};
+
+/* a png opened by png2gba_open, until png2gba_close */
+struct Converter {
+	const struct png2gba_options *options;
+	struct PngReader reader;
+	struct Image *image;
+	struct Stats *stats;
+
+	/* the palette the image goes into, the batch's own when one is being
+	 * built, or own_palette, and NULL for 16-bit color */
+	struct png2gba_palette *palette;
+	struct png2gba_palette own_palette;
+};
+
+/* keeping stats for --stats */
+double png2gba_stats_clock(void);
+double png2gba_stats_start(struct Stats *stats);
+
+/* reading pngs into GBA colors or palette indices */
+void png2gba_rgb_to_15(const png_byte *src,
+					   int channels,
+					   unsigned short *dst,
+					   int count);
+enum png2gba_error png2gba_alloc_work(struct Image *image, int count);
+void png2gba_free_rows(struct Image *image);
+void png2gba_free_image(struct Image *image);
+enum png2gba_error png2gba_read_png(const unsigned char *data,
+									size_t size,
+									struct Image **image);
+
+/* building palettes */
+int png2gba_insert_palette(unsigned short color,
+						   struct png2gba_palette* palette);
+unsigned short png2gba_hex24_to_15(const char *hex24);
+
+/* putting images into tile order */
+void png2gba_tileize_8(const unsigned char *src,
+					   int stride,
+					   int width,
+					   int height,
+					   unsigned char *dst);
+int png2gba_valid_frame(int width, int height);
+
+/* compressing and writing arrays */
+void png2gba_emit_begin(struct Emitter *emitter,
+						struct Outputs *outputs,
+						FILE *out,
+						int size,
+						const char *name,
+						const char *suffix);
+void png2gba_emit_value(struct Emitter *emitter, unsigned int value);
+enum png2gba_error png2gba_emit_end(struct Emitter *emitter);
+
+/* converting a whole png into files opened by the caller, as the
+ * png2gba command does */
+enum png2gba_error png2gba_open(struct Converter *converter,
+								const struct png2gba_options *options,
+								const unsigned char *data,
+								size_t size,
+								struct Image *image,
+								struct Stats *stats);
+enum png2gba_error png2gba_write(struct Converter *converter,
+								 const char *name,
+								 FILE **files,
+								 const char *header_name,
+								 char *output_buffer);
+void png2gba_close(struct Converter *converter);
+
+#endif